@@ -25,12 +25,22 @@ namespace this_coro = boost::asio::this_coro;
 #define P0_ITEM_SHARES_FILE "/data/p0_shares/p0_V.txt"
 #define P1_ITEM_SHARES_FILE "/data/p1_shares/p1_V.txt"
 
+// Binary (mmap-able) variants; used instead of the .txt files when present
+#define P0_USER_SHARES_BIN "/data/p0_shares/p0_U.bin"
+#define P1_USER_SHARES_BIN "/data/p1_shares/p1_U.bin"
+#define P0_ITEM_SHARES_BIN "/data/p0_shares/p0_V.bin"
+#define P1_ITEM_SHARES_BIN "/data/p1_shares/p1_V.bin"
+
 #define P0_QUERIES_SHARES_FILE "/data/p0_shares/p0_queries.txt"
 #define P1_QUERIES_SHARES_FILE "/data/p1_shares/p1_queries.txt"
 
 #define P0_MULT_SHARES_FILE "/data/p0_shares/p0_mult.txt"
 #define P1_MULT_SHARES_FILE "/data/p1_shares/p1_mult.txt"
 
+// Offline preprocessing bundles (prep_bundle.hpp); used instead of P2 when present
+#define P0_PREP_BUNDLE "/data/p0_shares/p0_prep.bundle"
+#define P1_PREP_BUNDLE "/data/p1_shares/p1_prep.bundle"
+
 inline uint32_t random_uint32() {
     static std::random_device rd;
     static std::mt19937 gen(rd());
@@ -156,5 +166,7 @@ struct DPFKey {
     uint64_t s0;
     bool t0;
     std::vector<DPFCorrectionWord> cws;
-    uint64_t cwOut;
+    std::vector<uint64_t> cwOuts; // one final correction word per output word
+    uint8_t prg = 0;              // PRGKind (prg.hpp) the key was generated with
+    uint8_t leaf_bits = 0;        // levels cut from the tree; each leaf covers 2^leaf_bits points
 };
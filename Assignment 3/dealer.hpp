@@ -0,0 +1,259 @@
+#pragma once
+
+#include "common.hpp"
+#include "prep_wire.hpp"
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ----------------------- Pipelined dealer -----------------------
+// P2's preprocessing is a list of jobs, each producing the next frame of bytes
+// for P0 and for P1. Generator threads run the jobs in any order into one
+// bounded queue per client, and a writer coroutine per client sends that
+// client's frames in job order, so generation, formatting and both sockets
+// overlap instead of taking turns on one core. In offline mode the writers
+// append to the clients' bundle files instead (prep_bundle.hpp).
+//
+// Online, a client pulls its material: every job is tagged with the first
+// query that needs it, and a writer sends a frame only once its client has
+// asked (with a Refill frame) for more queries than that tag. Generators stall
+// on the bounded queues meanwhile, so neither side holds more than a window.
+
+struct DealerFrame {
+    std::string bytes;
+    uint32_t query = 0; // first query the frame is for
+};
+
+struct DealerJobOutput {
+    DealerFrame p0, p1;
+};
+
+using DealerJobFn = std::function<DealerJobOutput()>;
+
+struct DealerJob {
+    uint32_t query = 0;
+    DealerJobFn make;
+};
+
+// The same bytes to both clients
+inline DealerJobFn broadcast_job(std::string bytes) {
+    return [bytes = std::move(bytes)] { return DealerJobOutput{{bytes}, {bytes}}; };
+}
+
+// Generator threads, taken from MPC_DEALER_THREADS (default: one per core)
+inline unsigned dealer_threads() {
+    const char* env = std::getenv("MPC_DEALER_THREADS");
+    int n = (env && *env) ? std::atoi(env) : 0;
+    if (n > 0) return static_cast<unsigned>(n);
+    unsigned hw = std::thread::hardware_concurrency();
+    return hw ? hw : 1;
+}
+
+// One client's frames, released in job order. put() blocks a generator while
+// its frame is capacity or more ahead of the writer; the writer awaits pop()
+// on the io_context, woken through a timer like run_on_workers in pB.cpp.
+class FrameQueue {
+public:
+    FrameQueue(boost::asio::io_context& io, std::size_t capacity)
+        : signal_(io, boost::asio::steady_timer::time_point::max()), capacity_(capacity) {}
+
+    void put(std::size_t seq, DealerFrame frame) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        space_.wait(lock, [&] { return closed_ || seq < next_ + capacity_; });
+        if (closed_) return;
+        ready_.emplace(seq, std::move(frame));
+        if (seq == next_) wake();
+    }
+
+    // No more frames; the writer drains what is ready and stops
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        space_.notify_all();
+        wake();
+    }
+
+    awaitable<std::optional<DealerFrame>> pop() {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = ready_.find(next_);
+                if (it != ready_.end()) {
+                    DealerFrame frame = std::move(it->second);
+                    ready_.erase(it);
+                    ++next_;
+                    space_.notify_all();
+                    co_return frame;
+                }
+                if (closed_) co_return std::nullopt;
+            }
+            // The io_context is single-threaded, so a wake() posted after the
+            // check above runs only once this wait has started
+            boost::system::error_code ec;
+            co_await signal_.async_wait(boost::asio::redirect_error(use_awaitable, ec));
+        }
+    }
+
+private:
+    void wake() {
+        boost::asio::post(signal_.get_executor(), [this] { signal_.cancel(); });
+    }
+
+    boost::asio::steady_timer signal_;
+    std::mutex mutex_;
+    std::condition_variable space_;
+    std::map<std::size_t, DealerFrame> ready_;
+    std::size_t next_ = 0;
+    const std::size_t capacity_;
+    bool closed_ = false;
+};
+
+// Queries one client has asked for so far. Only touched on the io_context.
+class DealerCredit {
+public:
+    explicit DealerCredit(boost::asio::io_context& io)
+        : signal_(io, boost::asio::steady_timer::time_point::max()) {}
+
+    // Returns once the client wants query `query`
+    awaitable<void> wait_for(uint32_t query) {
+        while (granted_ <= query) {
+            if (closed_) throw std::runtime_error("Client stopped asking for preprocessing");
+            boost::system::error_code ec;
+            co_await signal_.async_wait(boost::asio::redirect_error(use_awaitable, ec));
+        }
+    }
+
+    void grant(uint64_t queries) {
+        if (queries <= granted_) return;
+        granted_ = queries;
+        signal_.cancel();
+    }
+
+    void close() {
+        closed_ = true;
+        signal_.cancel();
+    }
+
+private:
+    boost::asio::steady_timer signal_;
+    uint64_t granted_ = 0;
+    bool closed_ = false;
+};
+
+inline awaitable<void> dealer_writer(tcp::socket& sock, FrameQueue& queue, DealerCredit& credit) {
+    while (std::optional<DealerFrame> frame = co_await queue.pop()) {
+        co_await credit.wait_for(frame->query);
+        co_await boost::asio::async_write(sock, boost::asio::buffer(frame->bytes), use_awaitable);
+    }
+}
+
+// A bundle is written in full, without credit
+inline awaitable<void> dealer_writer(std::ostream& out, FrameQueue& queue, DealerCredit&) {
+    while (std::optional<DealerFrame> frame = co_await queue.pop()) {
+        out.write(frame->bytes.data(), static_cast<std::streamsize>(frame->bytes.size()));
+        if (!out) throw std::runtime_error("Failed to write a preprocessing bundle");
+    }
+}
+
+// Grants a client's Refill requests until it hangs up. The connection stays
+// open until then, so a client never sends a refill to a closed socket.
+inline awaitable<void> dealer_refills(tcp::socket& sock, DealerCredit& credit) {
+    PrepReader in(sock);
+    try {
+        for (;;) credit.grant(co_await in.next_refill());
+    } catch (const boost::system::system_error&) {
+        // End of stream, or cancelled by dealer_stop_refills after an error
+    }
+    credit.close();
+}
+
+inline void dealer_start_refills(boost::asio::io_context& io, tcp::socket& sock, DealerCredit& credit,
+                                 std::function<void(std::exception_ptr)> on_done) {
+    co_spawn(io, dealer_refills(sock, credit), std::move(on_done));
+}
+
+inline void dealer_start_refills(boost::asio::io_context&, std::ostream&, DealerCredit&,
+                                 std::function<void(std::exception_ptr)>) {}
+
+inline void dealer_stop_refills(tcp::socket& sock) {
+    boost::system::error_code ec;
+    sock.cancel(ec);
+}
+
+inline void dealer_stop_refills(std::ostream&) {}
+
+// Runs jobs on n_threads generator threads and streams their frames to P0 and
+// P1 (two sockets, or two bundle streams), returning once everything is
+// written and, online, both clients have hung up. The first generator or
+// writer error is rethrown here.
+template <typename Sink>
+inline void run_dealer(boost::asio::io_context& io, Sink& sink0, Sink& sink1,
+                       const std::vector<DealerJob>& jobs, unsigned n_threads) {
+    FrameQueue q0(io, 4ull * n_threads), q1(io, 4ull * n_threads);
+    DealerCredit c0(io), c1(io);
+    std::exception_ptr error;
+    std::mutex error_mu;
+    auto fail = [&](std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock(error_mu);
+            if (!error) error = e;
+        }
+        q0.close();
+        q1.close();
+        boost::asio::post(io, [&] {
+            c0.close();
+            c1.close();
+        });
+    };
+
+    boost::asio::thread_pool generators(n_threads);
+    std::atomic<std::size_t> next_job{0};
+    std::atomic<unsigned> running{n_threads};
+    for (unsigned t = 0; t < n_threads; ++t) {
+        boost::asio::post(generators, [&] {
+            try {
+                for (std::size_t j; (j = next_job++) < jobs.size();) {
+                    DealerJobOutput out = jobs[j].make();
+                    out.p0.query = out.p1.query = jobs[j].query;
+                    q0.put(j, std::move(out.p0));
+                    q1.put(j, std::move(out.p1));
+                }
+            } catch (...) {
+                fail(std::current_exception());
+            }
+            if (running.fetch_sub(1) == 1) {
+                q0.close();
+                q1.close();
+            }
+        });
+    }
+
+    auto on_done = [&](std::exception_ptr e) { if (e) fail(e); };
+    dealer_start_refills(io, sink0, c0, on_done);
+    dealer_start_refills(io, sink1, c1, on_done);
+    auto on_writer_done = [&](std::exception_ptr e) {
+        if (!e) return;
+        dealer_stop_refills(sink0);
+        dealer_stop_refills(sink1);
+        fail(e);
+    };
+    co_spawn(io, dealer_writer(sink0, q0, c0), on_writer_done);
+    co_spawn(io, dealer_writer(sink1, q1, c1), on_writer_done);
+    io.restart();
+    io.run();
+    generators.join();
+    if (error) std::rethrow_exception(error);
+}
@@ -0,0 +1,369 @@
+#pragma once
+
+#include "common.hpp"
+#include "prg.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+// ----------------------- DPF (shared by P2 and P0/P1) -----------------------
+// Additive 2-party DPF over Z_2^64 (same construction as gen_dpf.cpp), with a
+// vector payload: a key with K final correction words evaluates to K output
+// words per domain point from a single root-to-leaf traversal.
+//
+// Early termination: a key with leaf_bits = c stops the tree c levels above
+// the domain, and each of its leaves covers 2^c consecutive points. A leaf
+// seed expands into 2^c x K words (point-major), each with its own final
+// correction word, so cws shrinks by c levels and EvalFull runs 2^c times
+// fewer PRG node expansions.
+
+static inline int bit_at(uint64_t x, int pos_from_msb, int nbits){
+    int shift = (nbits - 1 - pos_from_msb);
+    return int((x >> shift) & 1ULL);
+}
+
+// Tree depth for a domain of domain_size points: ceil(log2(domain_size))
+static inline int dpf_depth(uint64_t domain_size){
+    int nbits = 0;
+    uint64_t tmp = 1;
+    while (tmp < domain_size) { tmp <<= 1; ++nbits; }
+    return nbits;
+}
+
+// Output word d of a leaf seed. Word 0 is the seed itself, so a single-output
+// key means exactly what it did before vector payloads existed.
+static inline uint64_t leaf_word(PRGKind prg, uint64_t s, size_t d){
+    return d == 0 ? s : prg_word(prg, s, C_V + d);
+}
+
+static inline PRGKind dpf_prg(const DPFKey &key){
+    return static_cast<PRGKind>(key.prg);
+}
+
+// Output words per domain point (K)
+static inline size_t dpf_width(const DPFKey &key){
+    return key.cwOuts.size() >> key.leaf_bits;
+}
+
+// Depth of the key's tree for a domain of depth nbits
+static inline int dpf_tree_depth(const DPFKey &key, int nbits){
+    return nbits - key.leaf_bits;
+}
+
+// Tree leaves covering [0, domain_size)
+static inline uint64_t dpf_leaf_count(const DPFKey &key, uint64_t domain_size){
+    return ((domain_size - 1) >> key.leaf_bits) + 1;
+}
+
+// Default leaf_bits for a domain of depth nbits and k output words per point:
+// pack points until a leaf holds about 32 words, from MPC_DPF_LEAF_BITS if set
+static inline int dpf_default_leaf_bits(int nbits, size_t k){
+    const char* env = std::getenv("MPC_DPF_LEAF_BITS");
+    int c = 0;
+    if (env && *env) c = std::atoi(env);
+    else while ((k << (c + 1)) <= 32) ++c;
+    return std::max(0, std::min(c, nbits));
+}
+
+struct DPFPair {
+    DPFKey k0, k1;
+    int nbits;
+    uint64_t domain_size;
+    uint64_t alpha;
+    std::vector<uint64_t> beta;
+};
+
+// Keys for f(alpha) = beta (beta.size() output words), f(x) = 0 elsewhere,
+// expanded with the given PRG and leaf_bits levels cut from the bottom
+static inline DPFPair generateDPF(uint64_t domain_size, uint64_t alpha, const std::vector<uint64_t> &beta,
+                                  std::mt19937_64 &rng, PRGKind prg = PRGKind::SMix, int leaf_bits = 0){
+    if (domain_size == 0) throw std::runtime_error("domain_size must be >= 1");
+    if (alpha >= domain_size) throw std::runtime_error("alpha out of range");
+    if (beta.empty()) throw std::runtime_error("beta must have at least one word");
+
+    int nbits = dpf_depth(domain_size);
+    if (leaf_bits < 0 || leaf_bits > nbits) throw std::runtime_error("leaf_bits out of range");
+    const int depth = nbits - leaf_bits;
+    const uint64_t alpha_leaf = alpha >> leaf_bits;
+    const uint64_t alpha_slot = alpha & ((1ull << leaf_bits) - 1);
+
+    uint64_t sA = rng();
+    uint64_t sB = rng();
+    bool tA = 0;
+    bool tB = 1;
+
+    DPFKey kA, kB;
+    kA.s0 = sA; kA.t0 = tA; kA.prg = static_cast<uint8_t>(prg); kA.leaf_bits = static_cast<uint8_t>(leaf_bits);
+    kB.s0 = sB; kB.t0 = tB; kB.prg = static_cast<uint8_t>(prg); kB.leaf_bits = static_cast<uint8_t>(leaf_bits);
+    kA.cws.reserve(depth);
+    kB.cws.reserve(depth);
+
+    uint64_t sA_path = sA, sB_path = sB;
+    bool tA_path = tA, tB_path = tB;
+
+    for (int i = 0; i < depth; ++i){
+        int a_i = bit_at(alpha_leaf, i, depth);
+        // Both parties' path nodes in one batched PRG call
+        const uint64_t path[2] = {sA_path, sB_path};
+        uint64_t cL[2], cR[2];
+        uint8_t bL[2], bR[2];
+        prg_expand(prg, path, 2, cL, cR, bL, bR);
+        PRGOut gA{cL[0], cR[0], bL[0] != 0, bR[0] != 0};
+        PRGOut gB{cL[1], cR[1], bL[1] != 0, bR[1] != 0};
+
+        uint64_t dSL = gA.sL ^ gB.sL;
+        uint64_t dSR = gA.sR ^ gB.sR;
+        bool dTL = gA.tL ^ gB.tL;
+        bool dTR = gA.tR ^ gB.tR;
+
+        if (a_i == 0) dTL ^= 1;
+        else dTR ^= 1;
+
+        DPFCorrectionWord cw{dSL, dSR, dTL, dTR};
+        kA.cws.push_back(cw);
+        kB.cws.push_back(cw);
+
+        // Party A
+        uint64_t sL_A = gA.sL, sR_A = gA.sR;
+        bool tL_A = gA.tL, tR_A = gA.tR;
+        if (tA_path){
+            sL_A ^= cw.dSL; tL_A ^= cw.dTL;
+            sR_A ^= cw.dSR; tR_A ^= cw.dTR;
+        }
+        if (a_i == 0){ sA_path = sL_A; tA_path = tL_A; }
+        else { sA_path = sR_A; tA_path = tR_A; }
+
+        // Party B
+        uint64_t sL_B = gB.sL, sR_B = gB.sR;
+        bool tL_B = gB.tL, tR_B = gB.tR;
+        if (tB_path){
+            sL_B ^= cw.dSL; tL_B ^= cw.dTL;
+            sR_B ^= cw.dSR; tR_B ^= cw.dTR;
+        }
+        if (a_i == 0){ sB_path = sL_B; tB_path = tL_B; }
+        else { sB_path = sR_B; tB_path = tR_B; }
+    }
+
+    // One final correction word per output word of the leaf, XORed into the
+    // word of the party whose leaf control bit is 1 at alpha's leaf. Only
+    // alpha's slot gets beta; the other points of the leaf get 0.
+    const size_t width = beta.size();
+    std::vector<uint64_t> cwOuts(width << leaf_bits);
+    for (size_t j = 0; j < cwOuts.size(); ++j) {
+        const uint64_t b = (j / width == alpha_slot) ? beta[j % width] : 0;
+        uint64_t wA = leaf_word(prg, sA_path, j), wB = leaf_word(prg, sB_path, j);
+        cwOuts[j] = tA_path ? wA ^ (b + wB) : wB ^ (wA - b);
+    }
+
+    kA.cwOuts = cwOuts; kB.cwOuts = cwOuts;
+
+    DPFPair res;
+    res.k0 = kA; res.k1 = kB;
+    res.nbits = nbits;
+    res.domain_size = domain_size;
+    res.alpha = alpha;
+    res.beta = beta;
+    return res;
+}
+
+// Output words of n consecutive leaves (seeds s, control bits t), one batched
+// prg_mix per leaf word. Leaf i covers points i * 2^leaf_bits + slot; out is
+// n * 2^leaf_bits points x width words, point-major (out[x * width + d]) or,
+// with word_major, width x points (out[d * points + x]) so each output
+// word is one contiguous run.
+static inline void dpf_leaf_out_batch(const DPFKey &key, const uint64_t *s, const uint8_t *t, size_t n,
+                                      uint64_t *out, std::vector<uint64_t> &words, bool word_major = false){
+    const size_t width = dpf_width(key);
+    const size_t per_leaf = key.cwOuts.size(); // 2^leaf_bits x width
+    const size_t slots = size_t(1) << key.leaf_bits;
+    const size_t points = n * slots;
+    const uint64_t sign = key.t0 ? ~0ull : 0ull; // negate for party 1
+    words.resize(n);
+    for (size_t j = 0; j < per_leaf; ++j){
+        const uint64_t *w = s;
+        if (j > 0){
+            prg_mix(dpf_prg(key), s, n, C_V + j, words.data());
+            w = words.data();
+        }
+        const uint64_t cw = key.cwOuts[j];
+        const size_t slot = j / width, d = j % width;
+        uint64_t *o = word_major ? out + d * points + slot : out + j;
+        const size_t stride = word_major ? slots : per_leaf;
+        for (size_t i = 0; i < n; ++i){
+            uint64_t y = w[i] ^ (cw & (0ull - t[i]));
+            o[i * stride] = (y ^ sign) - sign;
+        }
+    }
+}
+
+// Evaluate DPF at a single point, writing dpf_width(key) output words to out
+static inline void evalDPF(const DPFKey &key, uint64_t x, int nbits, uint64_t *out){
+    uint64_t s = key.s0;
+    bool t = key.t0;
+    const int depth = dpf_tree_depth(key, nbits);
+    const uint64_t leaf = x >> key.leaf_bits;
+
+    for (int i = 0; i < depth; ++i){
+        PRGOut g = prg_node(dpf_prg(key), s);
+        uint64_t sL = g.sL, sR = g.sR;
+        bool tL = g.tL, tR = g.tR;
+        const DPFCorrectionWord &cw = key.cws[i];
+        if (t){
+            sL ^= cw.dSL; tL ^= cw.dTL;
+            sR ^= cw.dSR; tR ^= cw.dTR;
+        }
+        int b = bit_at(leaf, i, depth);
+        if (b == 0){ s = sL; t = tL; }
+        else { s = sR; t = tR; }
+    }
+
+    const size_t width = dpf_width(key);
+    const size_t slot = x & ((uint64_t(1) << key.leaf_bits) - 1);
+    for (size_t d = 0; d < width; ++d) {
+        const size_t j = slot * width + d;
+        uint64_t y = leaf_word(dpf_prg(key), s, j);
+        if (t) y ^= key.cwOuts[j];
+        if (key.t0) y = 0ull - y; // negate for party 1
+        out[d] = y;
+    }
+}
+
+// Scratch space for dpf_expand, reused across levels and blocks
+struct DPFExpandBuffers {
+    std::vector<uint64_t> next_seeds, sL, sR;
+    std::vector<uint8_t> next_bits, tL, tR;
+};
+
+// Level-by-level expansion of consecutive nodes [first, first + seeds.size())
+// at depth `level` down to depth `to_level` of a tree with `leaves` leaves at
+// depth `depth`, keeping at each depth only the nodes that still cover a
+// live leaf. Every node is expanded once, and each level goes through the
+// batched PRG in one call.
+static inline void dpf_expand(const DPFKey &key, std::vector<uint64_t> &seeds, std::vector<uint8_t> &bits,
+                              int &level, uint64_t &first, int to_level, uint64_t leaves, int depth,
+                              DPFExpandBuffers &buf){
+    for (; level < to_level; ++level){
+        // Nodes at depth level+1 covering [0, leaves)
+        const uint64_t live = ((leaves - 1) >> (depth - 1 - level)) + 1;
+        const uint64_t count = std::min<uint64_t>(2 * seeds.size(), live - 2 * first);
+        const uint64_t parents = (count + 1) / 2;
+        buf.sL.resize(parents); buf.sR.resize(parents);
+        buf.tL.resize(parents); buf.tR.resize(parents);
+        prg_expand(dpf_prg(key), seeds.data(), parents, buf.sL.data(), buf.sR.data(), buf.tL.data(), buf.tR.data());
+
+        // Apply the level's correction word where t = 1 and interleave children
+        buf.next_seeds.resize(2 * parents);
+        buf.next_bits.resize(2 * parents);
+        const DPFCorrectionWord cw = key.cws[level];
+        const uint64_t *sL = buf.sL.data(), *sR = buf.sR.data();
+        const uint8_t *tL = buf.tL.data(), *tR = buf.tR.data(), *t = bits.data();
+        uint64_t *ns = buf.next_seeds.data();
+        uint8_t *nt = buf.next_bits.data();
+        for (uint64_t p = 0; p < parents; ++p){
+            const uint64_t m = 0ull - t[p]; // all ones where t = 1
+            ns[2 * p] = sL[p] ^ (cw.dSL & m);
+            ns[2 * p + 1] = sR[p] ^ (cw.dSR & m);
+            nt[2 * p] = tL[p] ^ (cw.dTL & t[p]);
+            nt[2 * p + 1] = tR[p] ^ (cw.dTR & t[p]);
+        }
+        buf.next_seeds.resize(count);
+        buf.next_bits.resize(count);
+        seeds.swap(buf.next_seeds);
+        bits.swap(buf.next_bits);
+        first *= 2;
+    }
+}
+
+// Nodes of one level of the key's tree, used to hand disjoint subtrees to
+// worker threads
+struct DPFFrontier {
+    int level = 0;
+    std::vector<uint64_t> seeds;
+    std::vector<uint8_t> bits;
+};
+
+// Expands from the root until a level has at least min_nodes live nodes (or
+// the leaves, or max_level, are reached). A node at level l covers points
+// [i << (nbits - l), (i + 1) << (nbits - l)) whatever the key's leaf_bits, so
+// frontiers of several keys at the same level split the domain identically.
+static inline DPFFrontier dpf_frontier(const DPFKey &key, uint64_t domain_size, int nbits, uint64_t min_nodes,
+                                       int max_level = 64){
+    DPFFrontier f;
+    f.seeds = {key.s0};
+    f.bits = {key.t0};
+    uint64_t first = 0;
+    DPFExpandBuffers buf;
+    const int depth = dpf_tree_depth(key, nbits);
+    const uint64_t leaves = dpf_leaf_count(key, domain_size);
+    const int stop = std::min(depth, max_level);
+    while (f.level < stop && f.seeds.size() < min_nodes){
+        dpf_expand(key, f.seeds, f.bits, f.level, first, f.level + 1, leaves, depth, buf);
+    }
+    return f;
+}
+
+// Points per block in dpf_eval_subtrees (2^DPF_BLOCK_BITS): a block's levels
+// and output stay in cache while it is expanded
+static constexpr int DPF_BLOCK_BITS = 12;
+
+// Evaluates the subtrees under frontier nodes [lo, hi), in domain order, and
+// hands each block of points to sink(first_x, count, words), where words holds
+// count x width output words, point-major, or width x count with WordMajor
+// (see dpf_leaf_out_batch). The words buffer is reused for the
+// next block, so the full-domain output never exists at once. Disjoint
+// [lo, hi) ranges produce disjoint x ranges, so they can run on different
+// threads. Breadth-first down to the block level, then one block at a time.
+template <bool WordMajor = false, typename Sink>
+static inline void dpf_eval_subtrees(const DPFKey &key, const DPFFrontier &f, uint64_t lo, uint64_t hi,
+                                     uint64_t domain_size, int nbits, Sink &&sink){
+    std::vector<uint64_t> seeds(f.seeds.begin() + lo, f.seeds.begin() + hi);
+    std::vector<uint8_t> bits(f.bits.begin() + lo, f.bits.begin() + hi);
+    int level = f.level;
+    uint64_t first = lo;
+    DPFExpandBuffers buf;
+    const int depth = dpf_tree_depth(key, nbits);
+    const uint64_t leaves = dpf_leaf_count(key, domain_size);
+    const int block_depth = std::max(0, DPF_BLOCK_BITS - static_cast<int>(key.leaf_bits));
+    dpf_expand(key, seeds, bits, level, first, std::max(level, depth - block_depth), leaves, depth, buf);
+
+    const size_t width = dpf_width(key);
+    std::vector<uint64_t> block_seeds, words, block_out;
+    std::vector<uint8_t> block_bits;
+    for (size_t j = 0; j < seeds.size(); ++j){
+        block_seeds.assign(1, seeds[j]);
+        block_bits.assign(1, bits[j]);
+        int block_level = level;
+        uint64_t block_first = first + j;
+        dpf_expand(key, block_seeds, block_bits, block_level, block_first, depth, leaves, depth, buf);
+
+        // The last leaf may run past domain_size; only whole points are handed out
+        const uint64_t x0 = block_first << key.leaf_bits;
+        const uint64_t points = uint64_t(block_seeds.size()) << key.leaf_bits;
+        const uint64_t count = std::min(points, domain_size - x0);
+        block_out.resize(points * width);
+        dpf_leaf_out_batch(key, block_seeds.data(), block_bits.data(), block_seeds.size(), block_out.data(), words,
+                           WordMajor);
+        if (WordMajor && count < points){
+            for (size_t d = 1; d < width; ++d){
+                std::copy(block_out.begin() + d * points, block_out.begin() + d * points + count,
+                          block_out.begin() + d * count);
+            }
+        }
+        sink(x0, count, static_cast<const uint64_t *>(block_out.data()));
+    }
+}
+
+// Evaluate DPF over the full domain: domain_size x dpf_width(key) words, row-major.
+// ~2n / 2^leaf_bits calls to G instead of n*log n for per-point evaluation.
+static inline std::vector<uint64_t> evalFullDPF(const DPFKey &key, uint64_t domain_size, int nbits){
+    const size_t width = dpf_width(key);
+    std::vector<uint64_t> result(domain_size * width);
+    if (domain_size == 0) return result;
+    DPFFrontier root = dpf_frontier(key, domain_size, nbits, 1);
+    dpf_eval_subtrees(key, root, 0, 1, domain_size, nbits, [&](uint64_t x, uint64_t count, const uint64_t *words){
+        std::copy(words, words + count * width, result.data() + x * width);
+    });
+    return result;
+}
@@ -5,10 +5,19 @@ Creates user matrix, item matrix, and queries with proper formatting
 """
 
 import random
+import struct
 import sys
 import os
 
-def generate_shares(m, n, k, q):
+def write_binary_matrix(path, rows):
+    """Write a matrix in the row-major binary format read by share_store.hpp"""
+    cols = len(rows[0]) if rows else 0
+    with open(path, "wb") as f:
+        f.write(struct.pack("<4sIIIQQ", b"SHMX", 1, 0, 0, len(rows), cols))
+        for row in rows:
+            f.write(struct.pack(f"<{cols}q", *row))
+
+def generate_shares(m, n, k, q, binary=False):
     """Generate secret shares for users, items, and queries"""
 
     print(f"Generating test data: m={m}, n={n}, k={k}, q={q}")
@@ -53,6 +62,27 @@ def generate_shares(m, n, k, q):
 
     print(f"  Item profiles: {n} items, {k} dimensions")
 
+    # Plaintext profiles, for replay_check.py
+    for path, M in (("data/plain_U.txt", U), ("data/plain_V.txt", V)):
+        with open(path, "w") as f:
+            f.write(f"{len(M)} {k}\n")
+            for row in M:
+                f.write(" ".join(map(str, row)) + "\n")
+
+    bin_paths = ["data/p0_shares/p0_U.bin", "data/p1_shares/p1_U.bin",
+                 "data/p0_shares/p0_V.bin", "data/p1_shares/p1_V.bin"]
+    if binary:
+        for path, rows in zip(bin_paths, [U0, U1, V0, V1]):
+            write_binary_matrix(path, rows)
+        print("  Binary share matrices written (*.bin)")
+    else:
+        # The clients prefer a .bin file over the .txt one, so a stale one
+        # from an earlier --binary run would hide the new shares
+        for path in bin_paths:
+            if os.path.exists(path):
+                os.remove(path)
+                print(f"  Removed stale {path}")
+
     # Generate queries (format: user_idx item_idx v[0] ... v[k-1])
     print("Generating queries...")
     queries = []
@@ -90,12 +120,14 @@ def generate_shares(m, n, k, q):
     print(f"  Files created in data/ directory")
 
 if __name__ == "__main__":
-    if len(sys.argv) == 5:
-        m, n, k, q = map(int, sys.argv[1:5])
+    args = [a for a in sys.argv[1:] if a != "--binary"]
+    binary = len(args) != len(sys.argv) - 1
+    if len(args) == 4:
+        m, n, k, q = map(int, args)
     else:
         # Default parameters
         m, n, k, q = 10, 20, 5, 8
         print(f"Using default parameters: m={m}, n={n}, k={k}, q={q}")
-        print("Usage: python3 gen_test_data.py <m> <n> <k> <q>")
+        print("Usage: python3 gen_test_data.py <m> <n> <k> <q> [--binary]")
 
-    generate_shares(m, n, k, q)
+    generate_shares(m, n, k, q, binary)
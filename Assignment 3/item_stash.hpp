@@ -0,0 +1,128 @@
+#pragma once
+
+#include "prg.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// ----------------------- Item update engines -----------------------
+// DPF:   every query adds a full-domain DPF evaluation to V (Theta(n k) per query).
+// Stash: square-root ORAM-style epochs. For an epoch of S queries V is kept
+//        under a secret permutation Pi known only to P2. Query i of the epoch
+//        reveals one fresh physical row p_i (Pi(item) the first time the item
+//        is seen, Pi of some untouched item otherwise), and the update goes
+//        through a DPF over the rows revealed so far, {p_0, ..., p_i}. Since
+//        Pi is random and no row is revealed twice, the servers only see
+//        distinct random rows. At the end of the epoch V is re-permuted by a
+//        two-party shuffle, so the per-query cost is O(S k) plus the
+//        O(n k / S) share of the shuffle: O(sqrt(n) k) for S = sqrt(n).
+enum class ItemEngine : uint8_t { DPF = 0, Stash = 1 };
+
+// Engine P2 deals for, from MPC_ITEM_ENGINE=dpf|stash (default dpf)
+static inline ItemEngine item_engine_from_env(){
+    const char* env = std::getenv("MPC_ITEM_ENGINE");
+    if (!env || !*env || std::strcmp(env, "dpf") == 0) return ItemEngine::DPF;
+    if (std::strcmp(env, "stash") == 0) return ItemEngine::Stash;
+    throw std::runtime_error(std::string("Unknown MPC_ITEM_ENGINE: ") + env);
+}
+
+// Queries per stash epoch for n items, from MPC_STASH_SIZE (default ceil(sqrt(n))),
+// at most n so every query can reveal a fresh row
+static inline uint32_t stash_epoch_size(uint64_t n){
+    const char* env = std::getenv("MPC_STASH_SIZE");
+    long long s = (env && *env) ? std::atoll(env) : 0;
+    if (s <= 0) s = static_cast<long long>(std::ceil(std::sqrt(static_cast<double>(n))));
+    if (s > static_cast<long long>(n)) s = static_cast<long long>(n);
+    return static_cast<uint32_t>(s < 1 ? 1 : s);
+}
+
+// Rows of a stash epoch: item j is stored in row perm[j]. The dealer keeps
+// only the seed and rebuilds the permutation where it needs it; no seed
+// means item order.
+static inline std::vector<uint32_t> stash_epoch_perm(std::optional<uint64_t> seed, size_t n){
+    std::vector<uint32_t> perm(n);
+    for (size_t j = 0; j < n; ++j) perm[j] = static_cast<uint32_t>(j);
+    if (seed) {
+        std::mt19937_64 rng(*seed);
+        std::shuffle(perm.begin(), perm.end(), rng);
+    }
+    return perm;
+}
+
+// ----------------------- Two-party shuffle -----------------------
+// Re-permutes a secret-shared n x k matrix X (row i moves to sigma[i]) with
+// sigma = sigma1 o sigma0, where P0 only learns sigma0 and P1 only sigma1.
+// Each half is one message from the masking party to the permuting party:
+//   half 0: P1 sends X1 - a;  P0: Y0 = sigma0(X0 + X1 - a) + w,  P1: Y1 = c
+//   half 1: P0 sends Y0 - a'; P1: Z1 = sigma1(Y1 + Y0 - a') + w', P0: Z0 = c'
+// with w = sigma0(a) - c and w' = sigma1(a') - c' dealt by P2 and the masks
+// (a, c), (a', c') expanded from seeds held by the masking party.
+struct StashShuffleShare {
+    std::vector<uint32_t> perm;  // the half this party applies
+    std::vector<uint64_t> w;     // sigma_b(a) - c for that half
+    uint64_t seed_a = 0, seed_c = 0; // masks for the half the peer applies
+};
+
+// Mask word i of a shuffle mask
+static inline uint64_t stash_mask(uint64_t seed, uint64_t i){
+    return smix(seed ^ (C_V + i));
+}
+
+static inline void stash_masks(uint64_t seed, size_t count, uint64_t* out){
+    for (size_t i = 0; i < count; ++i) out[i] = stash_mask(seed, i);
+}
+
+// dst row perm[i] = src row i, rows of k words
+static inline void permute_rows(const std::vector<uint32_t>& perm, const uint64_t* src, uint64_t* dst, size_t k){
+    for (size_t i = 0; i < perm.size(); ++i) {
+        std::memcpy(dst + static_cast<size_t>(perm[i]) * k, src + i * k, k * sizeof(uint64_t));
+    }
+}
+
+static inline bool is_permutation_of_rows(const std::vector<uint32_t>& perm){
+    std::vector<uint8_t> seen(perm.size(), 0);
+    for (uint32_t p : perm) {
+        if (p >= perm.size() || seen[p]) return false;
+        seen[p] = 1;
+    }
+    return true;
+}
+
+// Dealer side: P0's and P1's material for re-permuting n x k rows by sigma
+static inline std::pair<StashShuffleShare, StashShuffleShare>
+make_stash_shuffle(const std::vector<uint32_t>& sigma, size_t k, std::mt19937_64& rng){
+    const size_t n = sigma.size();
+    StashShuffleShare p0, p1;
+
+    // sigma0 uniform, sigma1 = sigma o sigma0^-1
+    p0.perm.resize(n);
+    for (size_t i = 0; i < n; ++i) p0.perm[i] = static_cast<uint32_t>(i);
+    std::shuffle(p0.perm.begin(), p0.perm.end(), rng);
+    p1.perm.resize(n);
+    for (size_t i = 0; i < n; ++i) p1.perm[p0.perm[i]] = sigma[i];
+
+    // Half 0 masks belong to P1, half 1 masks to P0
+    p1.seed_a = rng(); p1.seed_c = rng();
+    p0.seed_a = rng(); p0.seed_c = rng();
+
+    std::vector<uint64_t> a(n * k), c(n * k);
+    auto dealt_w = [&](const StashShuffleShare& masker, const std::vector<uint32_t>& perm) {
+        stash_masks(masker.seed_a, n * k, a.data());
+        stash_masks(masker.seed_c, n * k, c.data());
+        std::vector<uint64_t> w(n * k);
+        permute_rows(perm, a.data(), w.data(), k);
+        for (size_t i = 0; i < n * k; ++i) w[i] -= c[i];
+        return w;
+    };
+    p0.w = dealt_w(p1, p0.perm);
+    p1.w = dealt_w(p0, p1.perm);
+    return {std::move(p0), std::move(p1)};
+}
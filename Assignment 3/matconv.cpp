@@ -0,0 +1,44 @@
+// Converts share matrices between the text format ("rows cols\n" + rows)
+// and the binary mmap format read by ShareMatrix (see share_store.hpp).
+//
+//   ./matconv to-bin  <in> <out.bin> [--col-major]
+//   ./matconv to-text <in> <out.txt>
+//
+// The input may be in either format; it is detected from its first bytes.
+#include "share_store.hpp"
+#include <iostream>
+#include <string>
+
+int main(int argc, char* argv[]) {
+    if (argc < 4 || argc > 5) {
+        std::cerr << "Usage: ./matconv to-bin <in> <out.bin> [--col-major]\n"
+                  << "       ./matconv to-text <in> <out.txt>\n";
+        return 1;
+    }
+
+    const std::string mode = argv[1];
+    const std::string in_path = argv[2];
+    const std::string out_path = argv[3];
+    const bool col_major = (argc == 5 && std::string(argv[4]) == "--col-major");
+    if (argc == 5 && !col_major) {
+        std::cerr << "Unknown option: " << argv[4] << "\n";
+        return 1;
+    }
+
+    try {
+        const ShareMatrix M(in_path);
+        if (mode == "to-bin") {
+            M.save_binary(out_path, col_major ? MatrixLayout::ColMajor : MatrixLayout::RowMajor);
+        } else if (mode == "to-text") {
+            M.save_text(out_path);
+        } else {
+            std::cerr << "Unknown mode: " << mode << "\n";
+            return 1;
+        }
+        std::cout << in_path << " -> " << out_path << " (" << M.rows() << "x" << M.cols() << ")\n";
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
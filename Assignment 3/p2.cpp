@@ -1,6 +1,12 @@
 #include "common.hpp"
+#include "dpf.hpp"
+#include "item_stash.hpp"
+#include "dealer.hpp"
+#include "prep_wire.hpp"
+#include "prep_bundle.hpp"
 #include <boost/asio.hpp>
 #include <iostream>
+#include <optional>
 #include <random>
 #include <fstream>
 #include <vector>
@@ -9,210 +15,213 @@
 
 using boost::asio::ip::tcp;
 
-// DPF generation utilities (from gen_dpf.cpp)
-static inline uint64_t smix(uint64_t x){
-    x += 0x9E3779B97F4A7C15ull;
-    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
-    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
-    return x ^ (x >> 31);
-}
-
-static constexpr uint64_t C_L = 0xA5A5A5A5A5A5A5A5ull;
-static constexpr uint64_t C_R = 0xC3C3C3C3C3C3C3C3ull;
-static constexpr uint64_t C_TL = 0xB4B4B4B4B4B4B4B4ull;
-static constexpr uint64_t C_TR = 0xD2D2D2D2D2D2D2D2ull;
-
-struct PRGOut { uint64_t sL, sR; bool tL, tR; };
-
-static inline PRGOut G(uint64_t s){
-    uint64_t sL = smix(s ^ C_L);
-    uint64_t sR = smix(s ^ C_R);
-    bool tL = (smix(s ^ C_TL) & 1ULL);
-    bool tR = (smix(s ^ C_TR) & 1ULL);
-    return {sL, sR, tL, tR};
+// Original makerandom function
+inline auto makerandom(int k) {
+    DuAtAllahServer security(k);
+    auto [client0, client1] = security.generate_client_shares();
+    return std::make_pair(std::move(client0), std::move(client1));
 }
 
-static inline int bit_at(uint64_t x, int pos_from_msb, int nbits){
-    int shift = (nbits - 1 - pos_from_msb);
-    return int((x >> shift) & 1ULL);
+inline auto makerandommul() {
+    DuAtAllahMultServer dmuls;
+    DuAtAllahMultClient dmulc0, dmulc1;
+    dmulc0.x = dmuls.x0;
+    dmulc0.y = dmuls.y0;
+    // z0 + z1 = x0*y1 + x1*y0 cancels the cross terms left by the local
+    // completion a*(b + peer_y) - y*peer_x in secure_mpc_multiplication
+    dmulc0.z = dmuls.x0 * dmuls.y1 + dmuls.alpha;
+    dmulc1.x = dmuls.x1;
+    dmulc1.y = dmuls.y1;
+    dmulc1.z = dmuls.x1 * dmuls.y0 - dmuls.alpha;
+    return std::make_pair(std::move(dmulc0), std::move(dmulc1));
 }
 
-struct DPFPair {
-    DPFKey k0, k1;
-    int nbits;
-    uint64_t domain_size;
-    uint64_t alpha;
-    uint64_t beta;
-};
-
-static DPFPair generateDPF(uint64_t domain_size, uint64_t alpha, uint64_t beta, std::mt19937_64 &rng){
-    if (domain_size == 0) throw std::runtime_error("domain_size must be >= 1");
-    if (alpha >= domain_size) throw std::runtime_error("alpha out of range");
-
-    int nbits = 0; 
-    uint64_t tmp = 1; 
-    while (tmp < domain_size) { tmp <<= 1; ++nbits; }
-
-    uint64_t sA = rng();
-    uint64_t sB = rng();
-    bool tA = 0;
-    bool tB = 1;
-
-    DPFKey kA, kB; 
-    kA.s0 = sA; kA.t0 = tA; 
-    kB.s0 = sB; kB.t0 = tB;
-    kA.cws.reserve(nbits); 
-    kB.cws.reserve(nbits);
-
-    uint64_t sA_path = sA, sB_path = sB; 
-    bool tA_path = tA, tB_path = tB;
-
-    for (int i = 0; i < nbits; ++i){
-        int a_i = bit_at(alpha, i, nbits);
-        PRGOut gA = G(sA_path);
-        PRGOut gB = G(sB_path);
-
-        uint64_t dSL = gA.sL ^ gB.sL;
-        uint64_t dSR = gA.sR ^ gB.sR;
-        bool dTL = gA.tL ^ gB.tL;
-        bool dTR = gA.tR ^ gB.tR;
-
-        if (a_i == 0) dTL ^= 1; 
-        else dTR ^= 1;
-
-        DPFCorrectionWord cw{dSL, dSR, dTL, dTR};
-        kA.cws.push_back(cw);
-        kB.cws.push_back(cw);
-
-        // Party A
-        uint64_t sL_A = gA.sL, sR_A = gA.sR; 
-        bool tL_A = gA.tL, tR_A = gA.tR;
-        if (tA_path){ 
-            sL_A ^= cw.dSL; tL_A ^= cw.dTL; 
-            sR_A ^= cw.dSR; tR_A ^= cw.dTR; 
+// One item update: DPF keys with payload (r, 1) at alpha, i.e. k + 1 words
+// per point, each followed by that party's k-word additive share of the
+// random mask r (an ItemKeys record). The servers open d = M - r and add
+// y_r(x) + d * y_1(x), whose shares sum to M at alpha and 0 elsewhere.
+// With a fused item delta the payload is (x, x*y, y, 1), 2k + 2 words, and
+// the record carries shares of x[k] and y instead (see ItemDelta).
+void append_item_dpf(std::string& out0, std::string& out1, uint64_t domain_size, uint64_t alpha, int k,
+                     std::mt19937_64& rng, PRGKind prg, int leaf_bits, ItemDelta delta) {
+    if (delta == ItemDelta::Fused) {
+        std::vector<uint64_t> beta(2 * k + 2), x0(k + 1), x1(k + 1);
+        const uint64_t y = rng();
+        for (int d = 0; d < k; ++d) {
+            beta[d] = rng();
+            beta[k + d] = beta[d] * y;
         }
-        if (a_i == 0){ sA_path = sL_A; tA_path = tL_A; } 
-        else { sA_path = sR_A; tA_path = tR_A; }
-
-        // Party B
-        uint64_t sL_B = gB.sL, sR_B = gB.sR; 
-        bool tL_B = gB.tL, tR_B = gB.tR;
-        if (tB_path){ 
-            sL_B ^= cw.dSL; tL_B ^= cw.dTL; 
-            sR_B ^= cw.dSR; tR_B ^= cw.dTR; 
+        beta[2 * k] = y;
+        beta[2 * k + 1] = 1;
+        // x[k] then y, split into additive shares
+        for (int d = 0; d <= k; ++d) {
+            x0[d] = rng();
+            x1[d] = (d < k ? beta[d] : y) - x0[d];
         }
-        if (a_i == 0){ sB_path = sL_B; tB_path = tL_B; } 
-        else { sB_path = sR_B; tB_path = tR_B; }
-    }
+        auto dpf_pair = generateDPF(domain_size, alpha, beta, rng, prg, leaf_bits);
 
-    uint64_t cwOut;
-    if (tA_path) {
-        uint64_t s_star = beta + sB_path;
-        cwOut = sA_path ^ s_star;
-    } else {
-        uint64_t s_star = sA_path - beta;
-        cwOut = sB_path ^ s_star;
+        prep_put_dpf_key(out0, dpf_pair.k0);
+        prep_put_words(out0, x0.data(), x0.size());
+        prep_put_dpf_key(out1, dpf_pair.k1);
+        prep_put_words(out1, x1.data(), x1.size());
+        return;
     }
 
-    kA.cwOut = cwOut; kB.cwOut = cwOut;
+    std::vector<uint64_t> beta(k + 1), r0(k), r1(k);
+    for (int d = 0; d < k; ++d) {
+        beta[d] = rng();
+        r0[d] = rng();
+        r1[d] = beta[d] - r0[d];
+    }
+    beta[k] = 1;
+    auto dpf_pair = generateDPF(domain_size, alpha, beta, rng, prg, leaf_bits);
 
-    DPFPair res; 
-    res.k0 = kA; res.k1 = kB; 
-    res.nbits = nbits; 
-    res.domain_size = domain_size; 
-    res.alpha = alpha; 
-    res.beta = beta;
-    return res;
+    prep_put_dpf_key(out0, dpf_pair.k0);
+    prep_put_words(out0, r0.data(), r0.size());
+    prep_put_dpf_key(out1, dpf_pair.k1);
+    prep_put_words(out1, r1.data(), r1.size());
 }
 
-// Endian helpers
-static inline long long h2be64(long long x){
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return __builtin_bswap64(x);
-#else
-    return x;
-#endif
+// ----------------------- Dealer jobs -----------------------
+// Queries per correlation / triple / DPF key job
+static constexpr int DEALER_CHUNK = 256;
+
+// One Correlations record: X[k], Y[k], z
+static inline void put_correlation(std::string& out, const DuAtAllahClient& s) {
+    prep_put_words(out, s.X.data.data(), s.X.size());
+    prep_put_words(out, s.Y.data.data(), s.Y.size());
+    prep_put(out, s.z);
 }
 
-static inline int h2be32(int x){
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return __builtin_bswap32(x);
-#else
-    return x;
-#endif
+// Query correlations [first, last)
+static DealerJobFn correlation_job(int first, int last, int k) {
+    return [=] {
+        DealerJobOutput out;
+        const size_t at0 = prep_begin_frame(out.p0.bytes, PrepFrameType::Correlations, last - first, k);
+        const size_t at1 = prep_begin_frame(out.p1.bytes, PrepFrameType::Correlations, last - first, k);
+        for (int i = first; i < last; ++i) {
+            auto [s0, s1] = makerandom(k);
+            put_correlation(out.p0.bytes, s0);
+            put_correlation(out.p1.bytes, s1);
+        }
+        prep_end_frame(out.p0.bytes, at0);
+        prep_end_frame(out.p1.bytes, at1);
+        return out;
+    };
 }
 
-static inline uint64_t h2be64u(uint64_t x){
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return __builtin_bswap64(x);
-#else
-    return x;
-#endif
+// Multiplication triples of queries [first, last)
+static DealerJobFn triple_job(int first, int last, int triples_per_query) {
+    return [=] {
+        DealerJobOutput out;
+        const size_t at0 = prep_begin_frame(out.p0.bytes, PrepFrameType::Triples, last - first, triples_per_query);
+        const size_t at1 = prep_begin_frame(out.p1.bytes, PrepFrameType::Triples, last - first, triples_per_query);
+        for (int i = first; i < last; ++i) {
+            for (int j = 0; j < triples_per_query; ++j) {
+                auto [m0, m1] = makerandommul();
+                const long long t0[3] = {m0.x, m0.y, m0.z}, t1[3] = {m1.x, m1.y, m1.z};
+                prep_put_words(out.p0.bytes, t0, 3);
+                prep_put_words(out.p1.bytes, t1, 3);
+            }
+        }
+        prep_end_frame(out.p0.bytes, at0);
+        prep_end_frame(out.p1.bytes, at1);
+        return out;
+    };
 }
 
-// Original makerandom function
-inline auto makerandom(int k) {
-    DuAtAllahServer security(k);
-    auto [client0, client1] = security.generate_client_shares();
-    return std::make_pair(std::move(client0), std::move(client1));
+// Seeded query correlations [first, last): P0 expands all of its record from
+// its seed, P1 its X, Y and gets z1 = X0.Y1 + X1.Y0 - z0 explicitly
+static DealerJobFn seeded_correlation_job(int first, int last, int k, uint64_t seed) {
+    return [=] {
+        std::mt19937_64 rng(seed);
+        const uint64_t seed0 = rng(), seed1 = rng();
+        std::vector<long long> z1(last - first);
+        for (int j = 0; j < last - first; ++j) {
+            DuAtAllahClient s0 = prep_seeded_correlation(seed0, j, k);
+            DuAtAllahClient s1 = prep_seeded_correlation(seed1, j, k);
+            z1[j] = s0.X.dot_product(s1.Y) + s0.Y.dot_product(s1.X) - s0.z;
+        }
+        DealerJobOutput out;
+        prep_put_seeded(out.p0.bytes, PrepFrameType::SeededCorrelations, last - first, k, seed0, {});
+        prep_put_seeded(out.p1.bytes, PrepFrameType::SeededCorrelations, last - first, k, seed1, z1);
+        return out;
+    };
 }
 
-inline auto makerandommul() {
-    DuAtAllahMultServer dmuls;
-    DuAtAllahMultClient dmulc0, dmulc1;
-    dmulc0.x = dmuls.x0;
-    dmulc0.y = dmuls.y0;
-    dmulc0.z = dmuls.alpha;
-    dmulc1.x = dmuls.x1;
-    dmulc1.y = dmuls.y1;
-    dmulc1.z = -dmuls.alpha;
-    return std::make_pair(std::move(dmulc0), std::move(dmulc1));
+// Seeded multiplication triples of queries [first, last), z1 = x0*y1 + x1*y0 - z0
+static DealerJobFn seeded_triple_job(int first, int last, int triples_per_query, uint64_t seed) {
+    return [=] {
+        std::mt19937_64 rng(seed);
+        const uint64_t seed0 = rng(), seed1 = rng();
+        std::vector<long long> z1(static_cast<size_t>(last - first) * triples_per_query);
+        for (int j = 0; j < last - first; ++j) {
+            for (int t = 0; t < triples_per_query; ++t) {
+                const DuAtAllahMultClient m0 = prep_seeded_triple(seed0, j, triples_per_query, t);
+                const DuAtAllahMultClient m1 = prep_seeded_triple(seed1, j, triples_per_query, t);
+                z1[static_cast<size_t>(j) * triples_per_query + t] = m0.x * m1.y + m1.x * m0.y - m0.z;
+            }
+        }
+        DealerJobOutput out;
+        prep_put_seeded(out.p0.bytes, PrepFrameType::SeededTriples, last - first, triples_per_query, seed0, {});
+        prep_put_seeded(out.p1.bytes, PrepFrameType::SeededTriples, last - first, triples_per_query, seed1, z1);
+        return out;
+    };
 }
 
-// Append helper
-inline void appendshares(std::ofstream& f0, std::ofstream& f1, 
-                         const DuAtAllahClient& s0, const DuAtAllahClient& s1) {
-    int k = s0.X.size();
-    for(int i = 0; i < k; i++) f0 << s0.X[i] << (i == k - 1 ? "\n" : " ");
-    for(int i = 0; i < k; i++) f0 << s0.Y[i] << (i == k - 1 ? "\n" : " ");
-    f0 << s0.z << "\n\n";
-
-    for(int i = 0; i < k; i++) f1 << s1.X[i] << (i == k - 1 ? "\n" : " ");
-    for(int i = 0; i < k; i++) f1 << s1.Y[i] << (i == k - 1 ? "\n" : " ");
-    f1 << s1.z << "\n\n";
+// Item DPF keys for a run of queries, from the job's own RNG seed
+static DealerJobFn item_dpf_job(std::vector<uint64_t> items, uint64_t domain_size, int k, PRGKind prg,
+                              int leaf_bits, ItemDelta delta, uint64_t seed) {
+    return [=, items = std::move(items)] {
+        std::mt19937_64 rng(seed);
+        DealerJobOutput out;
+        const size_t at0 = prep_begin_frame(out.p0.bytes, PrepFrameType::ItemKeys, items.size(), k);
+        const size_t at1 = prep_begin_frame(out.p1.bytes, PrepFrameType::ItemKeys, items.size(), k);
+        for (uint64_t item : items) {
+            append_item_dpf(out.p0.bytes, out.p1.bytes, domain_size, item, k, rng, prg, leaf_bits, delta);
+        }
+        prep_end_frame(out.p0.bytes, at0);
+        prep_end_frame(out.p1.bytes, at1);
+        return out;
+    };
 }
 
-// Send DPF key
-void send_dpf_key(tcp::socket& sock, const DPFKey& key) {
-    // Send s0
-    uint64_t s0_be = h2be64u(key.s0);
-    boost::asio::write(sock, boost::asio::buffer(&s0_be, sizeof(s0_be)));
-
-    // Send t0
-    uint8_t t0_byte = key.t0 ? 1 : 0;
-    boost::asio::write(sock, boost::asio::buffer(&t0_byte, 1));
-
-    // Send number of cws
-    uint32_t num_cws = static_cast<uint32_t>(key.cws.size());
-    uint32_t num_cws_be = h2be32(num_cws);
-    boost::asio::write(sock, boost::asio::buffer(&num_cws_be, sizeof(num_cws_be)));
-
-    // Send each CW
-    for (const auto& cw : key.cws) {
-        uint64_t dSL_be = h2be64u(cw.dSL);
-        uint64_t dSR_be = h2be64u(cw.dSR);
-        uint8_t dTL_byte = cw.dTL ? 1 : 0;
-        uint8_t dTR_byte = cw.dTR ? 1 : 0;
-
-        boost::asio::write(sock, boost::asio::buffer(&dSL_be, sizeof(dSL_be)));
-        boost::asio::write(sock, boost::asio::buffer(&dSR_be, sizeof(dSR_be)));
-        boost::asio::write(sock, boost::asio::buffer(&dTL_byte, 1));
-        boost::asio::write(sock, boost::asio::buffer(&dTR_byte, 1));
-    }
+// One stash-engine query: the revealed row, then the DPF over the epoch's
+// first slot + 1 rows pointing at alpha
+static DealerJobFn stash_query_job(uint32_t row, uint32_t slot, uint64_t alpha, int k, PRGKind prg, ItemDelta delta,
+                                   uint64_t seed) {
+    return [=] {
+        std::mt19937_64 rng(seed);
+        DealerJobOutput out;
+        for (std::string* o : {&out.p0.bytes, &out.p1.bytes}) {
+            const size_t at = prep_begin_frame(*o, PrepFrameType::StashRow);
+            prep_put(*o, row);
+            prep_end_frame(*o, at);
+        }
+        const size_t at0 = prep_begin_frame(out.p0.bytes, PrepFrameType::ItemKeys, 1, k);
+        const size_t at1 = prep_begin_frame(out.p1.bytes, PrepFrameType::ItemKeys, 1, k);
+        append_item_dpf(out.p0.bytes, out.p1.bytes, slot + 1, alpha, k, rng, prg,
+                        dpf_default_leaf_bits(dpf_depth(slot + 1), item_dpf_width(k, delta)), delta);
+        prep_end_frame(out.p0.bytes, at0);
+        prep_end_frame(out.p1.bytes, at1);
+        return out;
+    };
+}
 
-    // Send cwOut
-    uint64_t cwOut_be = h2be64u(key.cwOut);
-    boost::asio::write(sock, boost::asio::buffer(&cwOut_be, sizeof(cwOut_be)));
+// Stash shuffle from epoch permutation `from` to `to` (see stash_epoch_perm)
+static DealerJobFn stash_shuffle_job(std::optional<uint64_t> from, std::optional<uint64_t> to, uint32_t n, int k,
+                                   uint64_t seed) {
+    return [=] {
+        const std::vector<uint32_t> prev = stash_epoch_perm(from, n), next = stash_epoch_perm(to, n);
+        std::vector<uint32_t> sigma(n);
+        for (uint32_t j = 0; j < n; ++j) sigma[prev[j]] = next[j];
+        std::mt19937_64 rng(seed);
+        auto [sh0, sh1] = make_stash_shuffle(sigma, k, rng);
+        DealerJobOutput out;
+        prep_put_stash_shuffle(out.p0.bytes, sh0, k);
+        prep_put_stash_shuffle(out.p1.bytes, sh1, k);
+        return out;
+    };
 }
 
 int main() {
@@ -220,21 +229,6 @@ int main() {
         std::cout << "P2 server starting...\n";
 
         boost::asio::io_context io_context;
-        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), 9002));
-
-        std::cout << "Listening on port 9002 for client connections...\n";
-
-        // Accept connections from P0 and P1
-        tcp::socket socket_p0(io_context);
-        tcp::socket socket_p1(io_context);
-
-        std::cout << "Waiting for P0 to connect...\n";
-        acceptor.accept(socket_p0);
-        std::cout << "P0 connected.\n";
-
-        std::cout << "Waiting for P1 to connect...\n";
-        acceptor.accept(socket_p1);
-        std::cout << "P1 connected.\n";
 
         // Read parameters
         std::ifstream params_file("/data/params.txt");
@@ -250,93 +244,43 @@ int main() {
         }
         std::cout << "Parameters: m=" << m << ", n=" << n << ", k=" << k << ", q=" << q << "\n";
 
-        // Open output files
-        std::ofstream f0("/data/p0_shares/client0.txt");
-        std::ofstream f1("/data/p1_shares/client1.txt");
-
-        if (!f0 || !f1) {
-            std::cerr << "Failed to open output files\n";
-            return 1;
-        }
-
-        // Generate q random shares for queries
-        std::cout << "Generating " << q << " query shares...\n";
-        for (int i = 0; i < q; ++i) {
-            auto [s0, s1] = makerandom(k);
-            appendshares(f0, f1, s0, s1);
-
-            std::ostringstream line;
-            for (int j = 0; j < k; ++j) {
-                line << s0.X[j];
-                if (j < k-1) line << " ";
-            }
-            line << "\n";
-            for (int j = 0; j < k; ++j) {
-                line << s0.Y[j];
-                if (j < k-1) line << " ";
-            }
-            line << "\n" << s0.z << "\n\n";
-
-            std::string data = line.str();
-            boost::asio::write(socket_p0, boost::asio::buffer(data));
-
-            line.str(""); line.clear();
-            for (int j = 0; j < k; ++j) {
-                line << s1.X[j];
-                if (j < k-1) line << " ";
-            }
-            line << "\n";
-            for (int j = 0; j < k; ++j) {
-                line << s1.Y[j];
-                if (j < k-1) line << " ";
-            }
-            line << "\n" << s1.z << "\n\n";
-
-            data = line.str();
-            boost::asio::write(socket_p1, boost::asio::buffer(data));
-        }
-
-        // Send terminator
-        std::string ok_msg = "OK\n";
-        boost::asio::write(socket_p0, boost::asio::buffer(ok_msg));
-        boost::asio::write(socket_p1, boost::asio::buffer(ok_msg));
-
-        std::cout << "Sent all query shares. Generating multiplication triples...\n";
-
-        // Generate multiplication triples: need 2k per query (k for dot product, k for update)
-        int triples_per_query = 2 * k;
-
-        std::ostringstream header;
-        header << "TRPL " << q << " " << triples_per_query << "\n";
-        std::string hdr = header.str();
-        boost::asio::write(socket_p0, boost::asio::buffer(hdr));
-        boost::asio::write(socket_p1, boost::asio::buffer(hdr));
-
-        for (int i = 0; i < q; ++i) {
-            for (int j = 0; j < triples_per_query; ++j) {
-                auto [m0, m1] = makerandommul();
-
-                std::ostringstream t0, t1;
-                t0 << m0.x << " " << m0.y << " " << m0.z << "\n";
-                t1 << m1.x << " " << m1.y << " " << m1.z << "\n";
-
-                boost::asio::write(socket_p0, boost::asio::buffer(t0.str()));
-                boost::asio::write(socket_p1, boost::asio::buffer(t1.str()));
-            }
-        }
-
-        std::string tok_msg = "TOK\n";
-        boost::asio::write(socket_p0, boost::asio::buffer(tok_msg));
-        boost::asio::write(socket_p1, boost::asio::buffer(tok_msg));
-
-        std::cout << "Sent all multiplication triples.\n";
-
-        // Generate and send DPF keys for each query (Assignment 3)
-        std::cout << "Generating DPF keys for " << q << " queries...\n";
-
+        // Everything P2 sends is a list of jobs run by the pipelined dealer
+        // (dealer.hpp), each producing prep_wire.hpp frames: the manifest, then
+        // per chunk of queries their shares, multiplication triples and item
+        // material, so a client can start on the first chunk. Each job is
+        // tagged with the first query it serves, for the clients' refills.
         std::random_device rd;
         std::seed_seq seed{rd(), rd(), rd(), rd()};
         std::mt19937_64 rng(seed);
+        std::vector<DealerJob> jobs;
+
+        // Item update engine (MPC_ITEM_ENGINE=dpf|stash)
+        const ItemEngine item_engine = n > 0 ? item_engine_from_env() : ItemEngine::DPF;
+        const uint32_t stash_epoch = stash_epoch_size(n);
+
+        // How the item delta reaches the DPF (MPC_ITEM_DELTA=open|fused)
+        const ItemDelta item_delta = item_delta_from_env();
+
+        // Multiplication triples per query: k for the user update, and k for
+        // the item delta unless its masks come with the item DPF
+        const int triples_per_query = item_delta == ItemDelta::Fused ? k : 2 * k;
+
+        PrepManifest manifest;
+        manifest.queries = q;
+        manifest.k = k;
+        manifest.triples_per_query = triples_per_query;
+        manifest.engine = item_engine;
+        manifest.epoch = stash_epoch;
+        manifest.randomness = prep_randomness_from_env();
+        manifest.delta = item_delta;
+        std::string manifest_frame;
+        prep_put_manifest(manifest_frame, manifest);
+        jobs.push_back({0, broadcast_job(std::move(manifest_frame))});
+
+        // DPF keys for each query (Assignment 3)
+        // PRG the keys are expanded with (MPC_DPF_PRG=smix|aes)
+        const PRGKind dpf_prg_kind = prg_kind_from_env();
+        const int dpf_leaf_bits = dpf_default_leaf_bits(dpf_depth(n), item_dpf_width(k, item_delta));
 
         // Read queries to get item indices
         std::ifstream queries_file("/data/queries.txt");
@@ -347,8 +291,8 @@ int main() {
         long long q_count, k_count;
         queries_file >> q_count >> k_count;
 
+        std::vector<uint64_t> item_of(q);
         for (int qidx = 0; qidx < q; ++qidx) {
-            // Read query to get item index
             uint64_t user_idx, item_idx;
             if (queries_file) {
                 queries_file >> user_idx >> item_idx;
@@ -360,18 +304,117 @@ int main() {
             } else {
                 item_idx = rng() % n; // fallback to random
             }
+            item_of[qidx] = item_idx;
+        }
 
-            // Generate DPF with alpha=item_idx, beta=0 (user will adjust later)
-            auto dpf_pair = generateDPF(n, item_idx, 0, rng);
+        // Stash engine: pi maps each item to its physical row for the current
+        // epoch (stash_epoch_perm(pi_seed)); V starts and ends in item order
+        const bool use_stash = item_engine == ItemEngine::Stash && q > 0;
+        std::optional<uint64_t> pi_seed;
+        std::vector<uint32_t> pi;
+        std::vector<long long> seen_epoch(use_stash ? n : 0, -1); // epoch an item's row was revealed in
+        std::vector<uint32_t> seen_slot(use_stash ? n : 0);       // its position in that epoch
+        long long epoch_no = 0;
+        int cover = 0;                                            // next candidate untouched item
+
+        // Moves V from pi to a fresh random permutation, or back to item order
+        auto reshuffle = [&](uint32_t query, bool to_item_order) {
+            std::optional<uint64_t> next_seed;
+            if (!to_item_order) next_seed = rng();
+            jobs.push_back({query, stash_shuffle_job(pi_seed, next_seed, n, k, rng())});
+            pi_seed = next_seed;
+            pi = stash_epoch_perm(pi_seed, n);
+            ++epoch_no;
+            cover = 0;
+        };
+
+        auto stash_query = [&](int qidx) {
+            const uint64_t item_idx = item_of[qidx];
+            if (item_idx >= static_cast<uint64_t>(n)) throw std::runtime_error("Item index out of range");
+
+            // Reveal a fresh row: the item's own if it has not been seen this
+            // epoch, otherwise an untouched item's as cover. The DPF over the
+            // rows revealed so far points at the item's row either way.
+            const uint32_t slot = static_cast<uint32_t>(qidx % stash_epoch);
+            uint64_t fresh = item_idx;
+            uint64_t alpha = slot;
+            if (seen_epoch[item_idx] == epoch_no) {
+                alpha = seen_slot[item_idx];
+                while (seen_epoch[cover] == epoch_no) ++cover;
+                fresh = cover;
+            }
+            seen_epoch[fresh] = epoch_no;
+            seen_slot[fresh] = slot;
+            jobs.push_back({static_cast<uint32_t>(qidx), stash_query_job(pi[fresh], slot, alpha, k, dpf_prg_kind, item_delta, rng())});
 
-            // Send key0 to P0, key1 to P1
-            send_dpf_key(socket_p0, dpf_pair.k0);
-            send_dpf_key(socket_p1, dpf_pair.k1);
+            // Epoch over: re-permute V, back to item order after the last query
+            if (slot + 1 == stash_epoch || qidx + 1 == q) reshuffle(qidx, qidx + 1 == q);
+        };
 
-            std::cout << "  Sent DPF keys for query #" << qidx << " (item=" << item_idx << ")\n";
+        if (use_stash) {
+            std::cout << "Stash engine: " << stash_epoch << " queries per epoch\n";
+            reshuffle(0, false);
         }
 
-        std::cout << "All DPF keys sent. P2 server done.\n";
+        // Per chunk: random shares for the queries, then the triples
+        // (MPC_PREP_RANDOMNESS=explicit|seeded), then the item material
+        const bool seeded = manifest.randomness == PrepRandomness::Seeded;
+        for (int i = 0; i < q; i += DEALER_CHUNK) {
+            const int last = std::min(q, i + DEALER_CHUNK);
+            const uint32_t tag = static_cast<uint32_t>(i);
+            jobs.push_back({tag, seeded ? seeded_correlation_job(i, last, k, rng()) : correlation_job(i, last, k)});
+            jobs.push_back({tag, seeded ? seeded_triple_job(i, last, triples_per_query, rng())
+                                        : triple_job(i, last, triples_per_query)});
+            if (use_stash) {
+                for (int qidx = i; qidx < last; ++qidx) stash_query(qidx);
+            } else {
+                // DPF at alpha=item_idx with payload (r, 1) or (x, x*y, y, 1); key0 to P0, key1 to P1
+                std::vector<uint64_t> items(item_of.begin() + i, item_of.begin() + last);
+                jobs.push_back({tag, item_dpf_job(std::move(items), n, k, dpf_prg_kind, dpf_leaf_bits, item_delta, rng())});
+            }
+        }
+
+        const unsigned n_threads = dealer_threads();
+
+        // Offline: write each client's frames to its bundle and exit
+        if (prep_offline_from_env()) {
+            PrepBundleWriter bundle0(P0_PREP_BUNDLE, 0), bundle1(P1_PREP_BUNDLE, 1);
+            std::cout << "Dealing " << q << " queries (" << jobs.size() << " jobs) on " << n_threads
+                      << " generator threads to " << P0_PREP_BUNDLE << " and " << P1_PREP_BUNDLE << "...\n";
+            run_dealer(io_context, bundle0.out(), bundle1.out(), jobs, n_threads);
+            bundle0.close();
+            bundle1.close();
+            std::cout << "All shares, triples and DPF keys written. P2 done.\n";
+            return 0;
+        }
+
+        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), 9002));
+
+        std::cout << "Listening on port 9002 for client connections...\n";
+
+        // Accept connections from P0 and P1, in whichever order they come.
+        // Each says which party it is: the material is not symmetric (the
+        // stash shuffle composes sigma1 after sigma0), so it must not go by
+        // connection order.
+        tcp::socket first(io_context), second(io_context);
+        std::cout << "Waiting for P0 and P1 to connect...\n";
+        acceptor.accept(first);
+        const uint32_t first_party = prep_read_hello(first);
+        std::cout << "P" << first_party << " connected.\n";
+        acceptor.accept(second);
+        const uint32_t second_party = prep_read_hello(second);
+        if (second_party == first_party) {
+            throw std::runtime_error("Both clients claim to be P" + std::to_string(first_party));
+        }
+        std::cout << "P" << second_party << " connected.\n";
+        tcp::socket& socket_p0 = first_party == 0 ? first : second;
+        tcp::socket& socket_p1 = first_party == 0 ? second : first;
+
+        std::cout << "Dealing " << q << " queries (" << jobs.size() << " jobs) on " << n_threads
+                  << " generator threads, as the clients ask for it...\n";
+        run_dealer(io_context, socket_p0, socket_p1, jobs, n_threads);
+
+        std::cout << "All shares, triples and DPF keys sent. P2 server done.\n";
 
     } catch (std::exception& e) {
         std::cerr << "Exception in P2: " << e.what() << "\n";
@@ -1,12 +1,23 @@
 #include "common.hpp"
+#include "share_store.hpp"
+#include "dpf.hpp"
+#include "item_stash.hpp"
+#include "prep_wire.hpp"
+#include "prep_bundle.hpp"
+#include "peer_link.hpp"
+#include "pipeline.hpp"
 #include <boost/asio/awaitable.hpp>
 #include <boost/asio/co_spawn.hpp>
 #include <boost/asio/use_awaitable.hpp>
 #include <boost/asio/detached.hpp>
 #include <boost/asio/write.hpp>
 #include <boost/asio/read.hpp>
-#include <boost/asio/streambuf.hpp>
 #include <boost/asio/connect.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/this_coro.hpp>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -14,6 +25,15 @@
 #include <fstream>
 #include <cstring>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
 
 using boost::asio::awaitable;
 using boost::asio::use_awaitable;
@@ -23,78 +43,63 @@ using boost::asio::ip::tcp;
 #error "ROLE must be defined as ROLE_p0 or ROLE_p1"
 #endif
 
-// --- endian helpers (wire = big-endian) ---
-static inline long long h2be64(long long x){
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return __builtin_bswap64(x);
-#else
-    return x;
-#endif
-}
-
-static inline long long be2h64(long long x){
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return __builtin_bswap64(x);
-#else
-    return x;
-#endif
-}
-
-static inline int h2be32(int x){
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return __builtin_bswap32(x);
-#else
-    return x;
-#endif
+// ----------------------- Helper coroutines -----------------------
+awaitable<void> send_coroutine(tcp::socket& sock, int value) {
+    co_await boost::asio::async_write(sock, boost::asio::buffer(&value, sizeof(value)), use_awaitable);
 }
 
-static inline int be2h32(int x){
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return __builtin_bswap32(x);
-#else
-    return x;
-#endif
+awaitable<void> recv_coroutine(tcp::socket& sock, int& out) {
+    co_await boost::asio::async_read(sock, boost::asio::buffer(&out, sizeof(out)), use_awaitable);
 }
 
-static inline uint64_t h2be64u(uint64_t x){
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return __builtin_bswap64(x);
+static inline std::string user_matrix_path() {
+#ifdef ROLE_p0
+    return share_matrix_path(P0_USER_SHARES_BIN, P0_USER_SHARES_FILE);
 #else
-    return x;
+    return share_matrix_path(P1_USER_SHARES_BIN, P1_USER_SHARES_FILE);
 #endif
 }
 
-static inline uint64_t be2h64u(uint64_t x){
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return __builtin_bswap64(x);
+static inline std::string item_matrix_path() {
+#ifdef ROLE_p0
+    return share_matrix_path(P0_ITEM_SHARES_BIN, P0_ITEM_SHARES_FILE);
 #else
-    return x;
+    return share_matrix_path(P1_ITEM_SHARES_BIN, P1_ITEM_SHARES_FILE);
 #endif
 }
 
-// ----------------------- Helper coroutines -----------------------
-awaitable<void> send_coroutine(tcp::socket& sock, int value) {
-    co_await boost::asio::async_write(sock, boost::asio::buffer(&value, sizeof(value)), use_awaitable);
+// In-memory layout for a text item matrix, from MPC_ITEM_LAYOUT=row|col
+// (default row). Binary files keep the layout recorded in their header.
+static inline MatrixLayout item_text_layout() {
+    const char* env = std::getenv("MPC_ITEM_LAYOUT");
+    if (env && std::strcmp(env, "col") == 0) return MatrixLayout::ColMajor;
+    return MatrixLayout::RowMajor;
 }
 
-awaitable<void> recv_coroutine(tcp::socket& sock, int& out) {
-    co_await boost::asio::async_read(sock, boost::asio::buffer(&out, sizeof(out)), use_awaitable);
+// Queries whose item updates are applied together in one sweep of V, from
+// MPC_ITEM_BATCH (default 1: every query updates V before the next starts).
+static inline std::size_t item_batch_size() {
+    const char* env = std::getenv("MPC_ITEM_BATCH");
+    int n = (env && *env) ? std::atoi(env) : 0;
+    return n > 0 ? static_cast<std::size_t>(n) : 1;
 }
 
-static inline const char* user_matrix_path() {
+// The party id this client announces to P2, which routes its preprocessing
+// by it, and that its offline bundle must carry
+static inline uint32_t prep_party() {
 #ifdef ROLE_p0
-    return P0_USER_SHARES_FILE;
+    return 0;
 #else
-    return P1_USER_SHARES_FILE;
+    return 1;
 #endif
 }
 
-static inline const char* item_matrix_path() {
-#ifdef ROLE_p0
-    return P0_ITEM_SHARES_FILE;
-#else
-    return P1_ITEM_SHARES_FILE;
-#endif
+// Queries of preprocessing a client lets P2 run ahead, from MPC_PREP_WINDOW
+// (default 1024); see PrepPool
+static inline std::size_t prep_window() {
+    const char* env = std::getenv("MPC_PREP_WINDOW");
+    int n = (env && *env) ? std::atoi(env) : 0;
+    return n > 0 ? static_cast<std::size_t>(n) : 1024;
 }
 
 static inline const char* query_path() {
@@ -105,11 +110,24 @@ static inline const char* query_path() {
 #endif
 }
 
+// This party's offline preprocessing bundle; it must carry prep_party()
+static inline const char* prep_bundle_path() {
+#ifdef ROLE_p0
+    return P0_PREP_BUNDLE;
+#else
+    return P1_PREP_BUNDLE;
+#endif
+}
+
 // ----------------------- Setup connections -----------------------
 awaitable<tcp::socket> setup_server_connection(boost::asio::io_context& io_context, tcp::resolver& resolver) {
     tcp::socket sock(io_context);
     auto endpoints_p2 = resolver.resolve("p2", "9002");
     co_await boost::asio::async_connect(sock, endpoints_p2, use_awaitable);
+    // Both clients connect at once, so P2 learns who is who from this
+    std::string hello;
+    prep_put_hello(hello, prep_party());
+    co_await boost::asio::async_write(sock, boost::asio::buffer(hello), use_awaitable);
     co_return sock;
 }
 
@@ -134,13 +152,17 @@ static constexpr const char* SHARE_LOG_PATH = "/data/client1.shares";
 static constexpr const char* RESULT_LOG_PATH = "/data/client1.results";
 #endif
 
-static inline void append_my_share_to_file(const DuAtAllahClient& s, std::size_t idx) {
+// Correlations of queries first, first + 1, ...
+static inline void append_my_shares_to_file(std::size_t first, const std::vector<DuAtAllahClient>& store) {
     std::ofstream f(SHARE_LOG_PATH, std::ios::app);
     if (!f) { std::cerr << "Failed to open " << SHARE_LOG_PATH << " for append\n"; return; }
-    f << "# query " << idx << "\n";
-    for (size_t i = 0; i < s.X.size(); ++i) { if (i) f << ' '; f << s.X[i]; } f << '\n';
-    for (size_t i = 0; i < s.Y.size(); ++i) { if (i) f << ' '; f << s.Y[i]; } f << '\n';
-    f << s.z << "\n\n";
+    for (std::size_t idx = 0; idx < store.size(); ++idx) {
+        const DuAtAllahClient& s = store[idx];
+        f << "# query " << first + idx << "\n";
+        for (size_t i = 0; i < s.X.size(); ++i) { if (i) f << ' '; f << s.X[i]; } f << '\n';
+        for (size_t i = 0; i < s.Y.size(); ++i) { if (i) f << ' '; f << s.Y[i]; } f << '\n';
+        f << s.z << "\n\n";
+    }
 }
 
 static inline void append_result_share_to_file(std::size_t idx, random_vector& share_vector, int user_idx) {
@@ -152,219 +174,168 @@ static inline void append_result_share_to_file(std::size_t idx, random_vector& s
 }
 
 // ----------------------- Share reception + storage -----------------------
-static inline void rstrip_cr(std::string& s) {
-    if (!s.empty() && s.back() == '\r') s.pop_back();
-}
-
-awaitable<void> read_line(tcp::socket& sock, boost::asio::streambuf& buf, std::string& line) {
-    co_await boost::asio::async_read_until(sock, buf, '\n', use_awaitable);
-    std::istream is(&buf);
-    std::getline(is, line);
-    rstrip_cr(line);
-    co_return;
-}
-
-static inline random_vector parse_int_line(const std::string& line) {
-    std::vector<long long> out;
-    std::istringstream iss(line);
-    long long v;
-    while (iss >> v) out.push_back(v);
-    random_vector rv(0);
-    rv.data = out;
-    return rv;
-}
-
-awaitable<void> recv_all_shares_from_P2(tcp::socket& sock,
-                                         std::vector<DuAtAllahClient>& store,
-                                         std::vector<std::vector<DuAtAllahMultClient>>& mul_store) {
-    boost::asio::streambuf buf;
-    int idx = 0;
-
-    // --------- 1) READ SHARE LINES UNTIL "OK" ----------
-    for (;;) {
-        std::string line1;
-        do { co_await read_line(sock, buf, line1); } while (line1.empty());
-        if (line1 == "OK") break;
-
-        random_vector rv_temp = parse_int_line(line1);
-        DuAtAllahClient s(rv_temp.size());
-        s.X = rv_temp;
-
-        std::string line2; co_await read_line(sock, buf, line2);
-        s.Y = parse_int_line(line2);
-
-        std::string line3; co_await read_line(sock, buf, line3);
-        { std::istringstream iss(line3); iss >> s.z; }
-
-        std::string sep; co_await read_line(sock, buf, sep);
-        append_my_share_to_file(s, idx++);
-        store.emplace_back(std::move(s));
-    }
-
-    std::cout << "Total shares received from P2: " << store.size() << std::endl;
-
-    // --------- 2) READ MULTIPLICATION TRIPLES BLOCK ----------
-    std::string header;
-    co_await read_line(sock, buf, header);
-
-    std::istringstream hs(header);
-    std::string tag; int q = 0, k = 0;
-    if (!(hs >> tag >> q >> k) || tag != "TRPL" || q <= 0 || k <= 0) {
-        throw std::runtime_error("triples header malformed: " + header);
-    }
-
-    mul_store.assign(q, std::vector<DuAtAllahMultClient>(k));
-    for (int i = 0; i < q; ++i) {
-        for (int d = 0; d < k; ++d) {
-            std::string ln;
-            co_await read_line(sock, buf, ln);
-            std::istringstream ls(ln);
-            long long x, y, z;
-            if (!(ls >> x >> y >> z)) {
-                std::ostringstream oss;
-                oss << "triple parse error at (" << i << "," << d << ")";
-                throw std::runtime_error(oss.str());
-            }
-            mul_store[i][d].x = x;
-            mul_store[i][d].y = y;
-            mul_store[i][d].z = z;
-        }
-    }
-
-    std::string tok;
-    co_await read_line(sock, buf, tok);
-    if (tok != "TOK") {
-        throw std::runtime_error("triples terminator missing (expected TOK), got: " + tok);
-    }
-
-    std::cout << "Total multiplication triples received from P2: " << mul_store.size() << " sets of "
-              << (mul_store.empty() ? 0 : mul_store[0].size()) << " each\n";
-    co_return;
+// Seeded frame: the seed and, when P2 sent them, one explicit z per record
+// (`per_record` of them for triple frames)
+struct SeededFrame {
+    uint64_t seed = 0;
+    std::vector<long long> z;
+};
+
+static SeededFrame read_seeded_frame(PrepPayload& in, size_t per_record) {
+    SeededFrame f;
+    f.seed = in.get<uint64_t>();
+    const uint32_t nz = in.get<uint32_t>();
+    if (nz != 0 && nz != in.header.count * per_record) throw std::runtime_error("Seeded frame has a partial z vector");
+    f.z.resize(nz);
+    in.get_words(f.z.data(), nz);
+    in.expect_end();
+    return f;
 }
 
-// ----------------------- Matrix file I/O -----------------------
-static random_vector read_row_from_matrix_file(const std::string& path, int row_index) {
-    std::ifstream f(path);
-    if (!f) throw std::runtime_error("Failed to open " + path);
-    int rows=0, cols=0;
-    if (!(f >> rows >> cols)) {
-        throw std::runtime_error("Bad header in " + path);
+// One query's Du-Atallah correlation and multiplication triples
+struct QueryPrep {
+    DuAtAllahClient share;
+    std::vector<DuAtAllahMultClient> triples;
+};
+
+// Query correlations and triples received from P2 but not used yet. P2 deals
+// in chunks (correlations, triples, then the chunk's item material), and the
+// pool reads the next chunk only when a query needs it, so a client holds one
+// chunk at a time and starts once the first has arrived. Connected to P2, it
+// also keeps P2 at most `window` queries ahead: whenever fewer than window / 2
+// queries past the current one have been asked for (the low-water mark), it
+// sends a Refill for the next window.
+class PrepPool {
+public:
+    // p2: the socket refills go to, or null for a bundle (read in full)
+    PrepPool(PrepReader& prep, tcp::socket* p2, std::size_t window)
+        : prep_(prep), p2_(p2), window_(std::max<std::size_t>(window, 1)) {}
+
+    // Asks for the first window and reads the manifest
+    awaitable<PrepManifest> start() {
+        co_await request(window_);
+        m_ = co_await prep_.next_manifest();
+        if (m_.k == 0 || m_.triples_per_query == 0) throw std::runtime_error("P2 manifest malformed");
+        co_return m_;
     }
 
-    if (row_index < 0 || row_index >= rows) {
-        throw std::runtime_error("Row index out of range in " + path);
+    // Material of query i, taken in order
+    awaitable<QueryPrep> take(std::size_t i) {
+        if (i != base_) throw std::runtime_error("Preprocessing taken out of order");
+        if (requested_ < m_.queries && requested_ <= i + window_ / 2) co_await request(i + window_);
+        if (pool_.empty()) co_await recv_chunk();
+        QueryPrep out = std::move(pool_.front());
+        pool_.pop_front();
+        ++base_;
+        co_return out;
     }
 
-    std::string line;
-    std::getline(f, line); // consume end of header line
-    for (int r = 0; r < row_index; ++r) {
-        std::getline(f, line);
-        if (!f) throw std::runtime_error("Unexpected EOF while skipping rows in " + path);
+private:
+    awaitable<void> request(std::size_t queries) {
+        if (!p2_) co_return;
+        std::string frame;
+        prep_put_refill(frame, queries);
+        co_await boost::asio::async_write(*p2_, boost::asio::buffer(frame), use_awaitable);
+        requested_ = queries;
     }
 
-    std::getline(f, line);
-    if (!f) throw std::runtime_error("Unexpected EOF reading row in " + path);
-    std::istringstream iss(line);
-    std::vector<long long> row;
-    row.reserve(cols);
-    for (int c = 0; c < cols; ++c) {
-        long long v;
-        if (!(iss >> v)) {
-            throw std::runtime_error("Row parse error in " + path);
+    // The correlation and triple frames of the chunk starting at base_,
+    // explicit or seeded as the manifest says
+    awaitable<void> recv_chunk() {
+        const bool seeded = m_.randomness == PrepRandomness::Seeded;
+        if (base_ >= m_.queries) throw std::runtime_error("No preprocessing left for query " + std::to_string(base_));
+
+        // --------- 1) QUERY CORRELATIONS ----------
+        std::vector<DuAtAllahClient> store;
+        {
+            PrepPayload in = co_await prep_.next(seeded ? PrepFrameType::SeededCorrelations : PrepFrameType::Correlations);
+            if (in.header.width != m_.k || in.header.count == 0 || in.header.count > m_.queries - base_) {
+                throw std::runtime_error("Correlation frame does not match the manifest");
+            }
+            store.reserve(in.header.count);
+            if (seeded) {
+                const SeededFrame f = read_seeded_frame(in, 1);
+                for (uint32_t i = 0; i < in.header.count; ++i) {
+                    DuAtAllahClient s = prep_seeded_correlation(f.seed, i, m_.k);
+                    if (!f.z.empty()) s.z = f.z[i];
+                    store.push_back(std::move(s));
+                }
+            } else {
+                for (uint32_t i = 0; i < in.header.count; ++i) {
+                    DuAtAllahClient s;
+                    s.X.data.resize(m_.k);
+                    s.Y.data.resize(m_.k);
+                    in.get_words(s.X.data.data(), m_.k);
+                    in.get_words(s.Y.data.data(), m_.k);
+                    s.z = in.get<long long>();
+                    store.push_back(std::move(s));
+                }
+                in.expect_end();
+            }
         }
-        row.push_back(v);
-    }
-
-    random_vector vec(0);
-    vec.data = row;
-    return vec;
-}
+        append_my_shares_to_file(base_, store);
 
-static void update_row_in_matrix_file(const std::string& path, int row_index,
-                                      const std::vector<long long>& newrow) {
-    std::ifstream f(path);
-    if (!f) throw std::runtime_error("Failed to open " + path);
-    int rows=0, cols=0;
-    if (!(f >> rows >> cols)) throw std::runtime_error("Bad header in " + path);
-    if (row_index < 0 || row_index >= rows)
-        throw std::runtime_error("Row index out of range for update in " + path);
-
-    std::vector<std::vector<long long>> M(rows, std::vector<long long>(cols));
-    for (int r = 0; r < rows; ++r) {
-        for (int c = 0; c < cols; ++c) {
-            if (!(f >> M[r][c])) throw std::runtime_error("Matrix body parse error in " + path);
+        // --------- 2) MULTIPLICATION TRIPLES ----------
+        PrepPayload in = co_await prep_.next(seeded ? PrepFrameType::SeededTriples : PrepFrameType::Triples);
+        if (in.header.width != m_.triples_per_query || in.header.count != store.size()) {
+            throw std::runtime_error("Triple frame does not match the manifest");
         }
-    }
-    if ((int)newrow.size() != cols)
-        throw std::runtime_error("New row has wrong length in update for " + path);
-
-    M[row_index] = newrow;
-
-    const std::string tmp = path + ".tmp";
-    std::ofstream out(tmp);
-    if (!out) throw std::runtime_error("Failed to open temp " + tmp);
-    out << rows << " " << cols << "\n";
-    for (int r = 0; r < rows; ++r) {
-        for (int c = 0; c < cols; ++c) {
-            if (c) out << ' ';
-            out << M[r][c];
+        const SeededFrame f = seeded ? read_seeded_frame(in, m_.triples_per_query) : SeededFrame{};
+        for (uint32_t i = 0; i < in.header.count; ++i) {
+            QueryPrep q;
+            q.share = std::move(store[i]);
+            q.triples.resize(m_.triples_per_query);
+            for (uint32_t t = 0; t < m_.triples_per_query; ++t) {
+                DuAtAllahMultClient& m = q.triples[t];
+                if (seeded) {
+                    m = prep_seeded_triple(f.seed, i, m_.triples_per_query, t);
+                    if (!f.z.empty()) m.z = f.z[static_cast<size_t>(i) * m_.triples_per_query + t];
+                    continue;
+                }
+                long long xyz[3];
+                in.get_words(xyz, 3);
+                m.x = xyz[0];
+                m.y = xyz[1];
+                m.z = xyz[2];
+            }
+            pool_.push_back(std::move(q));
         }
-        out << "\n";
-    }
-    out.close();
+        if (!seeded) in.expect_end();
 
-    std::remove(path.c_str());
-    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
-        throw std::runtime_error("Failed to rename " + tmp + " -> " + path);
+        std::cout << "Received shares and " << m_.triples_per_query << " multiplication triples each for queries "
+                  << base_ << ".." << base_ + pool_.size() - 1 << " from P2\n";
     }
-}
-
-// ----------------------- Communication helpers -----------------------
-static inline awaitable<void> send_two_u64(tcp::socket& sock, long long u0, long long u1) {
-    long long be[2] = { h2be64(u0), h2be64(u1) };
-    co_await boost::asio::async_write(sock, boost::asio::buffer(be, sizeof(be)), use_awaitable);
-    co_return;
-}
 
-static inline awaitable<void> recv_two_u64(tcp::socket& sock, long long& u0, long long& u1) {
-    long long be[2];
-    co_await boost::asio::async_read(sock, boost::asio::buffer(be, sizeof(be)), use_awaitable);
-    u0 = be2h64(be[0]);
-    u1 = be2h64(be[1]);
-    co_return;
-}
+    PrepReader& prep_;
+    tcp::socket* p2_;
+    const std::size_t window_;
+    PrepManifest m_;
+    std::deque<QueryPrep> pool_; // queries base_, base_ + 1, ...
+    std::size_t base_ = 0;
+    std::size_t requested_ = 0;
+};
 
 // ----------------------- Barriers -----------------------
-awaitable<void> barrier_prep(tcp::socket& peer) {
+// Also checks that both parties start at the same query: a client resuming a
+// preprocessing bundle starts after its cursor
+awaitable<void> barrier_prep(tcp::socket& peer, int first_query) {
+    int peer_first = -1;
 #ifdef ROLE_p0
     int code = 1;
     co_await send_coroutine(peer, code);
+    co_await send_coroutine(peer, first_query);
     int ack; co_await recv_coroutine(peer, ack);
+    co_await recv_coroutine(peer, peer_first);
 #else
     int code; co_await recv_coroutine(peer, code);
+    co_await recv_coroutine(peer, peer_first);
     co_await send_coroutine(peer, code);
+    co_await send_coroutine(peer, first_query);
 #endif
-    co_return;
-}
-
-awaitable<void> barrier_query(tcp::socket& peer, int idx) {
-#ifdef ROLE_p0
-    int code = 2;
-    co_await send_coroutine(peer, code);
-    co_await send_coroutine(peer, idx);
-    int code2, idx2;
-    co_await recv_coroutine(peer, code2);
-    co_await recv_coroutine(peer, idx2);
-    if (code2 != 2 || idx2 != idx) {
-        std::cerr << "Barrier mismatch (sent idx=" << idx << ", got idx=" << idx2 << ")\n";
+    if (peer_first != first_query) {
+        throw std::runtime_error("Peer starts at query " + std::to_string(peer_first) + ", this party at " +
+                                 std::to_string(first_query));
     }
-#else
-    int code_in, idx_in;
-    co_await recv_coroutine(peer, code_in);
-    co_await recv_coroutine(peer, idx_in);
-    co_await send_coroutine(peer, code_in);
-    co_await send_coroutine(peer, idx_in);
-#endif
     co_return;
 }
 
@@ -408,198 +379,467 @@ static std::vector<std::vector<long long>> read_queries_file(const std::string&
 }
 
 // ----------------------- MPC multiplication -----------------------
-static awaitable<long long> secure_mpc_multiplication(long long a, long long b,
-                                                       DuAtAllahMultClient dmulc,
-                                                       tcp::socket& peer_sock){
-    long long myx = a + dmulc.x, myy = b + dmulc.y;
-    long long peerx, peery;
-
-#ifdef ROLE_p0
-    co_await send_two_u64(peer_sock, myx, myy);
-    co_await recv_two_u64(peer_sock, peerx, peery);
-#else
-    co_await recv_two_u64(peer_sock, peerx, peery);
-    co_await send_two_u64(peer_sock, myx, myy);
-#endif
-
-    long long c = a*(b + peery) - dmulc.y*(peerx) + dmulc.z;
-    co_return c;
+// Element-wise [a_i * b_i] for whole vectors in one round trip: every masked
+// pair (a_i + x_i, b_i + y_i) goes out in a single message as interleaved
+// int64s, then each product is completed locally as
+// c_i = a_i*(b_i + peer_y_i) - y_i*peer_x_i + z_i with triples[i].
+// The masked pairs are appended to `mine`, so other openings of the same
+// round can share the message.
+static void mult_masked_pairs(const std::vector<long long>& a, const std::vector<long long>& b,
+                              const DuAtAllahMultClient* triples, std::vector<long long>& mine) {
+    if (b.size() != a.size()) throw std::runtime_error("Length mismatch in batch multiplication");
+    for (size_t i = 0; i < a.size(); ++i) {
+        mine.push_back(a[i] + triples[i].x);
+        mine.push_back(b[i] + triples[i].y);
+    }
 }
 
-// ----------------------- DPF Key Exchange (Assignment 3) -----------------------
-// Send DPF key structure
-static awaitable<void> send_dpf_key(tcp::socket& sock, const DPFKey& key) {
-    // Send s0
-    uint64_t s0_be = h2be64u(key.s0);
-    co_await boost::asio::async_write(sock, boost::asio::buffer(&s0_be, sizeof(s0_be)), use_awaitable);
+// Completes the products from the peer's masked pairs
+static std::vector<long long> mult_complete(const std::vector<long long>& a, const std::vector<long long>& b,
+                                            const DuAtAllahMultClient* triples, const long long* peer) {
+    std::vector<long long> c(a.size());
+    for (size_t i = 0; i < a.size(); ++i) {
+        c[i] = a[i] * (b[i] + peer[2 * i + 1]) - triples[i].y * peer[2 * i] + triples[i].z;
+    }
+    return c;
+}
 
-    // Send t0 as uint8_t
-    uint8_t t0_byte = key.t0 ? 1 : 0;
-    co_await boost::asio::async_write(sock, boost::asio::buffer(&t0_byte, 1), use_awaitable);
+// Share of <u, v> from one Du-Atallah correlation (X, Y, z) with
+// z0 + z1 = X0.Y1 + X1.Y0: each party opens (X + u, Y + v) in a single
+// exchange and finishes locally.
+static awaitable<long long> mpc_dot_product(const random_vector& u, const random_vector& v,
+                                            const DuAtAllahClient& s, int qidx,
+                                            PeerLink& link) {
+    const size_t k = u.size();
+    if (v.size() != k || s.X.size() != k || s.Y.size() != k) {
+        throw std::runtime_error("Dimension mismatch in dot product");
+    }
 
-    // Send number of cws
-    uint32_t num_cws = static_cast<uint32_t>(key.cws.size());
-    uint32_t num_cws_be = h2be32(num_cws);
-    co_await boost::asio::async_write(sock, boost::asio::buffer(&num_cws_be, sizeof(num_cws_be)), use_awaitable);
+    // [X + u | Y + v]
+    std::vector<long long> mine(2 * k);
+    for (size_t j = 0; j < k; ++j) {
+        mine[j] = s.X[j] + u[j];
+        mine[k + j] = s.Y[j] + v[j];
+    }
+    const std::vector<long long> peer = co_await link.exchange(qidx, PeerStep::DotProduct, mine);
+    const long long* peer_x_sums = peer.data();
+    const long long* peer_y_sums = peer.data() + k;
+
+    // <u, v + peer_Y> - <Y, peer_X> + z
+    long long dot_share = s.z;
+    for (size_t j = 0; j < k; ++j) {
+        dot_share += u[j] * (v[j] + peer_y_sums[j]) - s.Y[j] * peer_x_sums[j];
+    }
+    co_return dot_share;
+}
 
-    // Send each correction word
-    for (const auto& cw : key.cws) {
-        uint64_t dSL_be = h2be64u(cw.dSL);
-        uint64_t dSR_be = h2be64u(cw.dSR);
-        uint8_t dTL_byte = cw.dTL ? 1 : 0;
-        uint8_t dTR_byte = cw.dTR ? 1 : 0;
+// ----------------------- Worker pool for DPF evaluation -----------------------
+// Threads used for full-domain DPF evaluation, taken from MPC_DPF_THREADS
+// (default: one per core).
+static inline unsigned dpf_worker_threads() {
+    const char* env = std::getenv("MPC_DPF_THREADS");
+    int n = (env && *env) ? std::atoi(env) : 0;
+    if (n > 0) return static_cast<unsigned>(n);
+    unsigned hw = std::thread::hardware_concurrency();
+    return hw ? hw : 1;
+}
 
-        co_await boost::asio::async_write(sock, boost::asio::buffer(&dSL_be, sizeof(dSL_be)), use_awaitable);
-        co_await boost::asio::async_write(sock, boost::asio::buffer(&dSR_be, sizeof(dSR_be)), use_awaitable);
-        co_await boost::asio::async_write(sock, boost::asio::buffer(&dTL_byte, 1), use_awaitable);
-        co_await boost::asio::async_write(sock, boost::asio::buffer(&dTR_byte, 1), use_awaitable);
+// Runs fn(0), ..., fn(ntasks - 1) on the pool and resumes the calling coroutine
+// once all of them have finished, so the io_context stays free meanwhile. The
+// first exception thrown by a task is rethrown here.
+static awaitable<void> run_on_workers(boost::asio::thread_pool& pool, std::size_t ntasks,
+                                      const std::function<void(std::size_t)>& fn) {
+    if (ntasks == 0) co_return;
+    auto ex = co_await boost::asio::this_coro::executor;
+    boost::asio::steady_timer done(ex, boost::asio::steady_timer::time_point::max());
+    std::atomic<std::size_t> remaining{ntasks};
+    std::exception_ptr error;
+    std::mutex error_mu;
+
+    for (std::size_t t = 0; t < ntasks; ++t) {
+        boost::asio::post(pool, [&, t] {
+            try {
+                fn(t);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mu);
+                if (!error) error = std::current_exception();
+            }
+            if (remaining.fetch_sub(1) == 1) {
+                boost::asio::post(ex, [&done] { done.cancel(); });
+            }
+        });
     }
 
-    // Send cwOut
-    uint64_t cwOut_be = h2be64u(key.cwOut);
-    co_await boost::asio::async_write(sock, boost::asio::buffer(&cwOut_be, sizeof(cwOut_be)), use_awaitable);
-
-    co_return;
+    boost::system::error_code ec;
+    co_await done.async_wait(boost::asio::redirect_error(use_awaitable, ec));
+    if (error) std::rethrow_exception(error);
 }
 
-// Receive DPF key structure
-static awaitable<DPFKey> recv_dpf_key(tcp::socket& sock) {
+// ----------------------- Assignment 3: Item Profile Update with DPF -----------------------
+// What the multiplication round leaves for a query's item update: this
+// party's share of M (open item delta), or the opened X = u_i + x and
+// Y = (1 - <u_i, v_j>) + y (fused; see ItemDelta in prep_wire.hpp)
+struct ItemDeltaShare {
+    std::vector<long long> M;
+    std::vector<uint64_t> X;
+    uint64_t Y = 0;
+};
+
+// An item update ready to apply: the query's DPF key, with payload (r, 1) at
+// the item (k + 1 words per point), and the opened d = M - r. The update
+// y_r(x) + d * y_1(x) sums to M at the item and to 0 everywhere else.
+// Fused, the payload is (x, x*y, y, 1), d = X*Y, and the update
+// d * y_1 - X * y_y - Y * y_x + y_xy sums to (X - x)(Y - y) = M.
+struct ItemDPF {
     DPFKey key;
+    ItemDelta delta = ItemDelta::Open;
+    std::vector<uint64_t> d;
+    std::vector<uint64_t> X; // fused only
+    uint64_t Y = 0;
+};
+
+// This party's share of the item update at one point, from the key's
+// item_dpf_width() output words w (stride apart)
+static inline uint64_t item_dpf_word(const ItemDPF& item, const uint64_t* w, size_t stride, int dim, int k) {
+    if (item.delta == ItemDelta::Open) return w[dim * stride] + item.d[dim] * w[k * stride];
+    return item.d[dim] * w[(2 * k + 1) * stride] - item.X[dim] * w[2 * k * stride] - item.Y * w[dim * stride] +
+           w[(k + dim) * stride];
+}
 
-    // Receive s0
-    uint64_t s0_be;
-    co_await boost::asio::async_read(sock, boost::asio::buffer(&s0_be, sizeof(s0_be)), use_awaitable);
-    key.s0 = be2h64u(s0_be);
-
-    // Receive t0
-    uint8_t t0_byte;
-    co_await boost::asio::async_read(sock, boost::asio::buffer(&t0_byte, 1), use_awaitable);
-    key.t0 = (t0_byte != 0);
+// Receives the DPF key P2 dealt for this query and opens d, giving this
+// party's share of a point function with value M = u_i * (1 - <u_i, v_j>) at
+// item_idx, without revealing item_idx. Adding its full-domain evaluation to
+// V (see apply_item_dpf_keys) performs the item update.
+static awaitable<ItemDPF> adjust_item_dpf_key(const long long item_idx,
+                                              const long long user_idx,
+                                              const ItemDeltaShare& delta,
+                                              ItemKeyShare share,
+                                              const ItemDelta mode,
+                                              PeerLink& link,
+                                              const int qidx,
+                                              const int n_items) {
+    std::cout << "Assignment 3: Updating item profile #" << item_idx << " (query by user #" << user_idx << ")\n";
 
-    // Receive number of cws
-    uint32_t num_cws_be;
-    co_await boost::asio::async_read(sock, boost::asio::buffer(&num_cws_be, sizeof(num_cws_be)), use_awaitable);
-    uint32_t num_cws = be2h32(num_cws_be);
+    const bool fused = mode == ItemDelta::Fused;
+    const int k = static_cast<int>(fused ? delta.X.size() : delta.M.size());
+
+    // Step 1: The DPF key and this party's share of its mask r (dealt by P2)
+    ItemDPF item;
+    item.key = std::move(share.key);
+    item.delta = mode;
+    // Each leaf carries item_dpf_width() words for each of its 2^leaf_bits points
+    if (item.key.leaf_bits > dpf_depth(n_items) ||
+        item.key.cwOuts.size() != (item_dpf_width(k, mode) << item.key.leaf_bits) ||
+        (fused ? share.x.size() : share.r.size()) != static_cast<size_t>(k)) {
+        throw std::runtime_error("DPF key has wrong number of output words");
+    }
 
-    // Receive each correction word
-    key.cws.resize(num_cws);
-    for (uint32_t i = 0; i < num_cws; ++i) {
-        uint64_t dSL_be, dSR_be;
-        uint8_t dTL_byte, dTR_byte;
+    // Fused: X and Y were opened with the multiplication, nothing to exchange
+    if (fused) {
+        item.X = delta.X;
+        item.Y = delta.Y;
+        item.d.resize(k);
+        for (int j = 0; j < k; ++j) item.d[j] = delta.X[j] * delta.Y;
+        co_return item;
+    }
+    const std::vector<long long>& r_share = share.r;
+
+    // Step 2: Open d = M - r; r is uniform, so d reveals nothing about M.
+    // All k differences go out as one frame.
+    std::cout << "  Opening masked item delta...\n";
+    std::vector<long long> my_diff(k);
+    for (int j = 0; j < k; ++j) {
+        my_diff[j] = static_cast<long long>(static_cast<uint64_t>(delta.M[j]) - static_cast<uint64_t>(r_share[j]));
+    }
+    const std::vector<long long> peer_diff = co_await link.exchange(qidx, PeerStep::ItemDelta, my_diff);
 
-        co_await boost::asio::async_read(sock, boost::asio::buffer(&dSL_be, sizeof(dSL_be)), use_awaitable);
-        co_await boost::asio::async_read(sock, boost::asio::buffer(&dSR_be, sizeof(dSR_be)), use_awaitable);
-        co_await boost::asio::async_read(sock, boost::asio::buffer(&dTL_byte, 1), use_awaitable);
-        co_await boost::asio::async_read(sock, boost::asio::buffer(&dTR_byte, 1), use_awaitable);
+    item.d.resize(k);
+    for (int j = 0; j < k; ++j) {
+        item.d[j] = static_cast<uint64_t>(my_diff[j]) + static_cast<uint64_t>(peer_diff[j]);
+    }
+    co_return item;
+}
 
-        key.cws[i].dSL = be2h64u(dSL_be);
-        key.cws[i].dSR = be2h64u(dSR_be);
-        key.cws[i].dTL = (dTL_byte != 0);
-        key.cws[i].dTR = (dTR_byte != 0);
+// Adds the full-domain evaluations of a batch of item updates to V in a
+// single sweep. All keys are split at the same tree level into subtrees of
+// about one cache block, so a subtree covers the same rows for every key:
+// each worker sums the batch's updates for a block in a small accumulator and
+// adds the sum to those rows once, so V is streamed once per batch instead of
+// once per query.
+static awaitable<void> apply_item_dpf_keys(const std::vector<ItemDPF>& items,
+                                           ShareMatrix& V_store,
+                                           boost::asio::thread_pool& workers,
+                                           unsigned n_workers) {
+    if (items.empty()) co_return;
+    std::cout << "  Evaluating " << items.size() << " DPF key(s) and applying update...\n";
+
+    const int n_items = V_store.rows();
+    const int k = V_store.cols();
+    const int nbits = dpf_depth(n_items);
+    int max_level = nbits;
+    for (const ItemDPF& item : items) {
+        if (dpf_width(item.key) != item_dpf_width(k, item.delta) || item.d.size() != static_cast<size_t>(k)) {
+            throw std::runtime_error("Dimension mismatch in item profile update");
+        }
+        max_level = std::min(max_level, dpf_tree_depth(item.key, nbits));
     }
 
-    // Receive cwOut
-    uint64_t cwOut_be;
-    co_await boost::asio::async_read(sock, boost::asio::buffer(&cwOut_be, sizeof(cwOut_be)), use_awaitable);
-    key.cwOut = be2h64u(cwOut_be);
+    const uint64_t min_nodes = std::max<uint64_t>(4ull * n_workers, static_cast<uint64_t>(n_items) >> DPF_BLOCK_BITS);
+    std::vector<DPFFrontier> frontiers;
+    frontiers.reserve(items.size());
+    for (const ItemDPF& item : items) {
+        frontiers.push_back(dpf_frontier(item.key, n_items, nbits, min_nodes, max_level));
+    }
+    const int level = frontiers[0].level;
+    const std::size_t n_nodes = frontiers[0].seeds.size();
+    const std::size_t n_tasks = std::min<std::size_t>(n_nodes, 4ull * n_workers);
+    const bool col_major = V_store.layout() == MatrixLayout::ColMajor;
+    const std::size_t width = dpf_width(items[0].key);
+
+    co_await run_on_workers(workers, n_tasks, [&](std::size_t t) {
+        const uint64_t lo = n_nodes * t / n_tasks, hi = n_nodes * (t + 1) / n_tasks;
+        const std::size_t last = items.size() - 1;
+        std::vector<uint64_t> acc;
+        for (uint64_t node = lo; node < hi; ++node) {
+            // Rows [first, first + rows) under this frontier node
+            const uint64_t first = node << (nbits - level);
+            const uint64_t rows = std::min<uint64_t>(uint64_t(1) << (nbits - level), n_items - first);
+            acc.resize(rows * k);
+
+            // The first updates of the batch are summed into acc; the last one
+            // adds acc plus its own update to V, so the rows are written once
+            for (std::size_t b = 0; b <= last; ++b) {
+                const ItemDPF& item = items[b];
+                if (col_major) {
+                    // One contiguous stream per dimension: V[:, dim] += sum[dim]
+                    dpf_eval_subtrees<true>(item.key, frontiers[b], node, node + 1, n_items, nbits,
+                                            [&](uint64_t x, uint64_t count, const uint64_t* words) {
+                        for (int dim = 0; dim < k; ++dim) {
+                            uint64_t* a = acc.data() + dim * rows + (x - first);
+                            long long* col = V_store.column_data(dim) + x;
+                            for (uint64_t i = 0; i < count; ++i) {
+                                const uint64_t y = item_dpf_word(item, words + i, count, dim, k);
+                                if (b == 0 && b < last) a[i] = y;
+                                else if (b < last) a[i] += y;
+                                else col[i] = static_cast<long long>(static_cast<uint64_t>(col[i]) + y + (b > 0 ? a[i] : 0));
+                            }
+                        }
+                    });
+                } else {
+                    dpf_eval_subtrees(item.key, frontiers[b], node, node + 1, n_items, nbits,
+                                      [&](uint64_t x, uint64_t count, const uint64_t* words) {
+                        uint64_t* a = acc.data() + (x - first) * k;
+                        for (uint64_t i = 0; i < count; ++i) {
+                            const uint64_t* w = words + i * width;
+                            long long* row = b == last ? V_store.row_data(static_cast<int>(x + i)) : nullptr;
+                            for (int dim = 0; dim < k; ++dim) {
+                                const uint64_t y = item_dpf_word(item, w, 1, dim, k);
+                                uint64_t& s = a[i * k + dim];
+                                if (b == 0 && b < last) s = y;
+                                else if (b < last) s += y;
+                                else row[dim] = static_cast<long long>(static_cast<uint64_t>(row[dim]) + y + (b > 0 ? s : 0));
+                            }
+                        }
+                    });
+                }
+            }
+        }
+    });
 
-    co_return key;
+    std::cout << "Item profiles updated for " << items.size() << " quer" << (items.size() == 1 ? "y" : "ies") << "\n";
+    co_return;
 }
 
-// ----------------------- DPF Evaluation (Assignment 3) -----------------------
-// PRG utilities (same as gen_dpf.cpp)
-static inline uint64_t smix(uint64_t x){
-    x += 0x9E3779B97F4A7C15ull;
-    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
-    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
-    return x ^ (x >> 31);
+// ----------------------- Assignment 3: Stash item engine -----------------------
+// V as a flat row-major n x k array of words, for the shuffle
+static std::vector<uint64_t> load_share_rows(const ShareMatrix& M) {
+    const size_t k = M.cols();
+    std::vector<uint64_t> out(static_cast<size_t>(M.rows()) * k);
+    for (int r = 0; r < M.rows(); ++r) {
+        for (int c = 0; c < M.cols(); ++c) out[r * k + c] = static_cast<uint64_t>(M.cell(r, c));
+    }
+    return out;
 }
 
-static constexpr uint64_t C_L = 0xA5A5A5A5A5A5A5A5ull;
-static constexpr uint64_t C_R = 0xC3C3C3C3C3C3C3C3ull;
-static constexpr uint64_t C_TL = 0xB4B4B4B4B4B4B4B4ull;
-static constexpr uint64_t C_TR = 0xD2D2D2D2D2D2D2D2ull;
+static void store_share_rows(ShareMatrix& M, const std::vector<uint64_t>& rows) {
+    const size_t k = M.cols();
+    for (int r = 0; r < M.rows(); ++r) {
+        for (int c = 0; c < M.cols(); ++c) M.cell(r, c) = static_cast<long long>(rows[r * k + c]);
+    }
+}
 
-struct PRGOut { uint64_t sL, sR; bool tL, tR; };
+// Re-permutes V with the shuffle P2 dealt for this epoch boundary (see
+// item_stash.hpp). Two one-way messages on the link under `query`: P1 -> P0,
+// then P0 -> P1.
+static awaitable<void> stash_shuffle(ShareMatrix& V_store, PeerLink& link, uint32_t query,
+                                     const StashShuffleShare& share) {
+    const size_t n = V_store.rows(), k = V_store.cols();
+    std::cout << "  Re-permuting item profiles (stash epoch boundary)...\n";
 
-static inline PRGOut G(uint64_t s){
-    uint64_t sL = smix(s ^ C_L);
-    uint64_t sR = smix(s ^ C_R);
-    bool tL = (smix(s ^ C_TL) & 1ULL);
-    bool tR = (smix(s ^ C_TR) & 1ULL);
-    return {sL, sR, tL, tR};
+    std::vector<uint64_t> x = load_share_rows(V_store), y(n * k), mask(n * k);
+    std::vector<long long> msg(n * k);
+#ifdef ROLE_p0
+    // Half 0: permute X0 + (X1 - a) by sigma0 and add w
+    msg = co_await link.recv(query, PeerStep::StashShuffle0);
+    if (msg.size() != n * k) throw std::runtime_error("Peer message has the wrong length");
+    for (size_t i = 0; i < n * k; ++i) x[i] += static_cast<uint64_t>(msg[i]);
+    permute_rows(share.perm, x.data(), y.data(), k);
+    for (size_t i = 0; i < n * k; ++i) y[i] += share.w[i];
+
+    // Half 1: mask Y0 for P1 and keep c'
+    stash_masks(share.seed_a, n * k, mask.data());
+    for (size_t i = 0; i < n * k; ++i) msg[i] = static_cast<long long>(y[i] - mask[i]);
+    link.send(query, PeerStep::StashShuffle1, msg);
+    stash_masks(share.seed_c, n * k, y.data());
+#else
+    // Half 0: mask X1 for P0 and keep c
+    stash_masks(share.seed_a, n * k, mask.data());
+    for (size_t i = 0; i < n * k; ++i) msg[i] = static_cast<long long>(x[i] - mask[i]);
+    link.send(query, PeerStep::StashShuffle0, msg);
+    stash_masks(share.seed_c, n * k, x.data());
+
+    // Half 1: permute Y1 + (Y0 - a') by sigma1 and add w'
+    msg = co_await link.recv(query, PeerStep::StashShuffle1);
+    if (msg.size() != n * k) throw std::runtime_error("Peer message has the wrong length");
+    for (size_t i = 0; i < n * k; ++i) x[i] += static_cast<uint64_t>(msg[i]);
+    permute_rows(share.perm, x.data(), y.data(), k);
+    for (size_t i = 0; i < n * k; ++i) y[i] += share.w[i];
+#endif
+    store_share_rows(V_store, y);
 }
 
-static inline int bit_at(uint64_t x, int pos_from_msb, int nbits){
-    int shift = (nbits - 1 - pos_from_msb);
-    return int((x >> shift) & 1ULL);
-}
+// One stash-engine item update: P2 revealed a fresh physical row for the
+// query, and its DPF over the rows revealed so far this epoch adds M to the
+// item's row, whichever of them it is.
+static void stash_apply_item(const ItemDPF& item, const uint32_t revealed, ShareMatrix& V_store,
+                             std::vector<int>& epoch_rows) {
+    const int row = static_cast<int>(revealed);
+    if (revealed >= static_cast<uint32_t>(V_store.rows()) || std::find(epoch_rows.begin(), epoch_rows.end(), row) != epoch_rows.end()) {
+        throw std::runtime_error("P2 revealed an invalid stash row");
+    }
+    epoch_rows.push_back(row);
 
-// Evaluate DPF at single point
-static uint64_t evalDPF(const DPFKey &key, uint64_t x, int nbits){
-    uint64_t s = key.s0; 
-    bool t = key.t0;
+    const int m = static_cast<int>(epoch_rows.size());
+    const std::vector<uint64_t> words = evalFullDPF(item.key, m, dpf_depth(m));
 
-    for (int i = 0; i < nbits; ++i){
-        PRGOut g = G(s);
-        uint64_t sL = g.sL, sR = g.sR; 
-        bool tL = g.tL, tR = g.tR;
-        const DPFCorrectionWord &cw = key.cws[i];
-        if (t){ 
-            sL ^= cw.dSL; tL ^= cw.dTL; 
-            sR ^= cw.dSR; tR ^= cw.dTR; 
+    const int k = V_store.cols();
+    for (int x = 0; x < m; ++x) {
+        const uint64_t* w = words.data() + static_cast<size_t>(x) * dpf_width(item.key);
+        for (int dim = 0; dim < k; ++dim) {
+            long long& cell = V_store.cell(epoch_rows[x], dim);
+            cell = static_cast<long long>(static_cast<uint64_t>(cell) + item_dpf_word(item, w, 1, dim, k));
         }
-        int b = bit_at(x, i, nbits);
-        if (b == 0){ s = sL; t = tL; } 
-        else { s = sR; t = tR; }
     }
-
-    if (t) s ^= key.cwOut;
-    uint64_t y = s; // v_from_seed is identity
-    if (key.t0) y = 0ull - y; // negate for party 1
-    return y;
+    std::cout << "Item profile update stashed (" << m << " rows this epoch)\n";
 }
 
-// Evaluate DPF over full domain
-static std::vector<uint64_t> evalFullDPF(const DPFKey &key, uint64_t domain_size, int nbits){
-    std::vector<uint64_t> result(domain_size);
-    for (uint64_t x = 0; x < domain_size; ++x){
-        result[x] = evalDPF(key, x, nbits);
+// ----------------------- Item update engines -----------------------
+// What P2 dealt for one query's item update. It is read off the stream in
+// query order before the query starts, as the queries in flight finish in any
+// order.
+struct ItemMaterial {
+    ItemKeyShare key;
+    uint32_t stash_row = 0;                   // stash engine: the row revealed
+    std::optional<StashShuffleShare> shuffle; // stash engine: the epoch ends here
+};
+
+// Item-side state of the query loop: the engine P2 deals for and what it has
+// queued (adjusted keys of the current batch, or the rows revealed in the
+// current stash epoch)
+struct ItemUpdates {
+    PrepManifest prep; // engine, queries per stash epoch, queries
+    std::size_t batch = 1;
+    std::vector<ItemDPF> keys;
+    std::vector<int> epoch_rows;
+};
+
+// Hands one query's item delta to the item engine. An open delta is opened
+// alongside the other queries in flight; V itself is updated through
+// item_turn, in query order. At a batch or epoch boundary (and always when
+// flush or last is set) V is brought up to date; a stash-engine V stays
+// permuted until the last query.
+static awaitable<void> update_item_profile(const long long item_idx,
+                                           const long long user_idx,
+                                           const ItemDeltaShare& delta,
+                                           ItemMaterial mat,
+                                           ItemUpdates& items,
+                                           const bool flush,
+                                           const bool last,
+                                           const int qidx,
+                                           PeerLink& link,
+                                           Turnstile& item_turn,
+                                           ShareMatrix& V_store,
+                                           boost::asio::thread_pool& workers,
+                                           unsigned n_workers) {
+    if (items.prep.engine == ItemEngine::Stash) {
+        // The DPF covers the rows revealed this epoch, this query's included
+        const int m = qidx % static_cast<int>(items.prep.epoch) + 1;
+        const ItemDPF item = co_await adjust_item_dpf_key(item_idx, user_idx, delta, std::move(mat.key),
+                                                          items.prep.delta, link, qidx, m);
+        co_await item_turn.enter(qidx);
+        stash_apply_item(item, mat.stash_row, V_store, items.epoch_rows);
+        // Epoch over: re-permute V (back to item order after the last query)
+        if (mat.shuffle) {
+            co_await stash_shuffle(V_store, link, qidx, *mat.shuffle);
+            items.epoch_rows.clear();
+        }
+        item_turn.leave();
+        co_return;
+    }
+
+    std::optional<ItemDPF> item;
+    if (V_store.rows() > 0) {
+        item = co_await adjust_item_dpf_key(item_idx, user_idx, delta, std::move(mat.key), items.prep.delta, link,
+                                            qidx, V_store.rows());
+    }
+    co_await item_turn.enter(qidx);
+    if (item) items.keys.push_back(std::move(*item));
+    if (items.keys.size() >= items.batch || flush || last) {
+        co_await apply_item_dpf_keys(items.keys, V_store, workers, n_workers);
+        items.keys.clear();
     }
-    return result;
+    item_turn.leave();
 }
 
-// ----------------------- Assignment 1: User Profile Update -----------------------
-static awaitable<void> update_user_profile_secure(const std::vector<long long>& query, 
-                                                    const int qidx,
-                                                    DuAtAllahClient& s, 
-                                                    std::vector<DuAtAllahMultClient>& vmuls,
-                                                    tcp::socket& peer_sock) {
+// ----------------------- Fused per-query update -----------------------
+// Both profile updates of a query share one secret-shared <u_i, v_j>:
+//   u_i <- u_i + v_j * (1 - <u_i, v_j>)   (Assignment 1)
+//   v_j <- v_j + u_i * (1 - <u_i, v_j>)   (Assignment 3, via DPF)
+// The dot product uses the query's Du-Atallah correlation, and both deltas
+// come out of a single 2k-wide batch multiplication on vmuls[0..2k). With a
+// fused item delta (see ItemDelta) that round multiplies only the user delta
+// on vmuls[0..k) and opens X = u_i + x and Y = (1 - <u_i, v_j>) + y with the
+// masks dealt alongside the item key. Returns what the item update engine
+// needs of the item delta.
+static awaitable<ItemDeltaShare> process_query_secure(const std::vector<long long>& query,
+                                                      const int qidx,
+                                                      DuAtAllahClient& s,
+                                                      std::vector<DuAtAllahMultClient>& vmuls,
+                                                      const ItemKeyShare& item_key,
+                                                      const ItemDelta mode,
+                                                      PeerLink& link,
+                                                      ShareMatrix& U_store) {
     const long long user_idx = static_cast<long long>(query[0]);
     std::cout << "Updating user profile for user #" << user_idx << "\n";
 
     // Read current user share
-    const std::string U_path = user_matrix_path();
-    random_vector user_share = read_row_from_matrix_file(U_path, user_idx);
+    random_vector user_share = U_store.read_row(user_idx);
 
     // Extract item profile from query (query format: [user_idx, item_idx, v[0], v[1], ..., v[k-1]])
-    random_vector item_share(query.size() - 2);
-    for (size_t i = 2; i < query.size(); ++i) {
-        item_share[i - 2] = query[i];
-    }
+    random_vector item_share;
+    item_share.data.assign(query.begin() + 2, query.end());
 
-    int k = user_share.size();
-    if ((int)item_share.size() != k || (int)s.X.size() != k) {
+    const int k = user_share.size();
+    const bool fused = mode == ItemDelta::Fused;
+    if ((int)item_share.size() != k || (int)s.X.size() != k || (int)vmuls.size() < (fused ? k : 2 * k)) {
         throw std::runtime_error("Dimension mismatch in user profile update");
     }
+    // Without items there is no item key, and nothing to open for it
+    const bool open_fused = fused && !item_key.x.empty();
+    if (open_fused && (int)item_key.x.size() != k) throw std::runtime_error("Dimension mismatch in item profile update");
 
-    // Step 1: Compute dot product share using MPC
-    long long dot_share = 0;
-    for (int i = 0; i < k; ++i) {
-        long long prod_share = co_await secure_mpc_multiplication(
-            user_share[i], item_share[i], vmuls[i], peer_sock);
-        dot_share += prod_share;
-    }
+    // Step 1: Compute dot product share with the query's Du-Atallah correlation
+    long long dot_share = co_await mpc_dot_product(user_share, item_share, s, qidx, link);
 
     // Step 2: Compute (1 - <ui, vj>) share
     // In additive sharing: [1] = [1]_0 + [1]_1 where one party gets 1, other gets 0
@@ -609,182 +849,220 @@ static awaitable<void> update_user_profile_secure(const std::vector<long long>&
     long long one_minus_dot_share = -dot_share;
 #endif
 
-    // Step 3: Compute update M = vj * (1 - <ui, vj>)
-    // Need k more multiplications
-    std::vector<long long> update_share(k);
-    for (int i = 0; i < k; ++i) {
-        update_share[i] = co_await secure_mpc_multiplication(
-            item_share[i], one_minus_dot_share, vmuls[k + i], peer_sock);
+    // Step 3: Both deltas in one round: [vj | ui] * (1 - <ui, vj>), or
+    // vj * (1 - <ui, vj>) followed by [ui + x | (1 - <ui, vj>) + y]
+    std::vector<long long> lhs(item_share.data);
+    if (!fused) lhs.insert(lhs.end(), user_share.data.begin(), user_share.data.end());
+    const std::vector<long long> rhs(lhs.size(), one_minus_dot_share);
+    std::vector<long long> mine;
+    mine.reserve(2 * lhs.size() + k + 1);
+    mult_masked_pairs(lhs, rhs, vmuls.data(), mine);
+    const size_t at = mine.size();
+    if (open_fused) {
+        for (int j = 0; j < k; ++j) mine.push_back(user_share[j] + item_key.x[j]);
+        mine.push_back(one_minus_dot_share + item_key.y);
     }
+    const std::vector<long long> peer = co_await link.exchange(qidx, PeerStep::Multiply, mine);
+    const std::vector<long long> deltas = mult_complete(lhs, rhs, vmuls.data(), peer.data());
 
-    // Step 4: Apply update to user profile
+    // Step 4: Apply update to user profile and write it back
     std::vector<long long> new_user_share(k);
     for (int i = 0; i < k; ++i) {
-        new_user_share[i] = user_share[i] + update_share[i];
+        new_user_share[i] = user_share[i] + deltas[i];
     }
-
-    // Step 5: Write back updated share
-    update_row_in_matrix_file(U_path, user_idx, new_user_share);
+    U_store.write_row(user_idx, new_user_share);
 
     random_vector result(0);
     result.data = new_user_share;
     append_result_share_to_file(qidx, result, user_idx);
 
     std::cout << "User profile #" << user_idx << " updated successfully\n";
-    co_return;
-}
 
-// ----------------------- Assignment 3: Item Profile Update with DPF -----------------------
-static awaitable<void> update_item_profile_with_dpf(const std::vector<long long>& query,
-                                                      const int qidx,
-                                                      DuAtAllahClient& s,
-                                                      std::vector<DuAtAllahMultClient>& vmuls,
-                                                      tcp::socket& peer_sock,
-                                                      tcp::socket& p2_sock,
-                                                      int n_items) {
-    const long long user_idx = static_cast<long long>(query[0]);
-    const long long item_idx = static_cast<long long>(query[1]);
-
-    std::cout << "Assignment 3: Updating item profile #" << item_idx << " (query by user #" << user_idx << ")\n";
-
-    // Read user profile share
-    const std::string U_path = user_matrix_path();
-    random_vector user_share = read_row_from_matrix_file(U_path, user_idx);
-
-    // Read item profile share
-    const std::string V_path = item_matrix_path();
-    random_vector item_share = read_row_from_matrix_file(V_path, item_idx);
-
-    int k = user_share.size();
-    if ((int)item_share.size() != k) {
-        throw std::runtime_error("Dimension mismatch in item profile update");
+    // Step 5: M = ui * (1 - <ui, vj>) for the item profile update, or the
+    // opened X and Y it is computed from
+    ItemDeltaShare delta;
+    if (!fused) {
+        delta.M.assign(deltas.begin() + k, deltas.end());
+    } else if (open_fused) {
+        delta.X.resize(k);
+        for (int j = 0; j <= k; ++j) {
+            const uint64_t opened = static_cast<uint64_t>(mine[at + j]) + static_cast<uint64_t>(peer[at + j]);
+            if (j < k) delta.X[j] = opened;
+            else delta.Y = opened;
+        }
     }
+    co_return delta;
+}
 
-    // Step 1: Receive DPF key from user (via P2)
-    // The user sends different keys to each server
-    std::cout << "  Receiving DPF key from user...\n";
-    DPFKey dpf_key = co_await recv_dpf_key(p2_sock);
-
-    // Step 2: Compute local share of update value M = ui * (1 - <ui, vj>)
-    std::cout << "  Computing update value share...\n";
+// ----------------------- Query pipeline -----------------------
+// What the queries in flight share (see pipeline.hpp)
+struct OnlineQueries {
+    PeerLink& link;
+    ChainTurnstile& user_turn; // user updates, in query order per user
+    Turnstile& item_turn; // item updates, in query order
+    ShareMatrix& U_store;
+    ShareMatrix& V_store;
+    ItemUpdates& items;
+    boost::asio::thread_pool& workers;
+    unsigned n_workers;
+};
+
+// One query in flight. Its user update waits for the previous query by the
+// same user, which wrote the U row it reads; queries by other users update
+// theirs meanwhile. Its item update then overlaps the next queries' user
+// updates.
+static awaitable<void> run_query(OnlineQueries& q, const std::vector<long long>& query, const int qidx,
+                                 QueryPrep prep, ItemMaterial mat, const bool flush, const bool last) {
+    // Assignment 1 + 3: user and item profile updates from one dot product
+    co_await q.user_turn.enter(qidx);
+    const ItemDeltaShare delta = co_await process_query_secure(query, qidx, prep.share, prep.triples, mat.key,
+                                                               q.items.prep.delta, q.link, q.U_store);
+    q.user_turn.leave(qidx);
+
+    // Item profile update with M
+    co_await update_item_profile(query[1], query[0], delta, std::move(mat), q.items, flush, last, qidx, q.link,
+                                 q.item_turn, q.V_store, q.workers, q.n_workers);
+    std::cout << "Query #" << qidx << " completed\n";
+}
 
-    // Compute dot product share
-    long long dot_share = 0;
-    for (int i = 0; i < k; ++i) {
-        long long prod_share = co_await secure_mpc_multiplication(
-            user_share[i], item_share[i], vmuls[i], peer_sock);
-        dot_share += prod_share;
+// ----------------------- Main execution loop -----------------------
+// A bundle resumes after the queries it has already served, whose updates
+// are in the share matrices: skips their material and returns the first
+// query to run. in_place: U or V is a binary matrix, which may hold updates
+// past the cursor.
+static awaitable<std::size_t> skip_consumed_queries(const PrepBundle& bundle, PrepReader& prep, PrepPool& pool,
+                                                    const PrepManifest& manifest, std::size_t n_queries,
+                                                    const bool in_place) {
+    const std::size_t first = static_cast<std::size_t>(bundle.cursor());
+    if (first > n_queries) throw std::runtime_error("Preprocessing bundle cursor is past the last query");
+    if (first > 0 && first == n_queries) {
+        throw std::runtime_error("Preprocessing bundle " + bundle.path() +
+                                 " is used up; deal a new one, or delete it (make clean_bundles) to deal online");
     }
-
-    // Compute (1 - <ui, vj>) share
-#ifdef ROLE_p0
-    long long one_minus_dot_share = 1 - dot_share;
-#else
-    long long one_minus_dot_share = -dot_share;
-#endif
-
-    // Compute M share = ui * (1 - <ui, vj>)
-    std::vector<long long> M_share_vec(k);
-    for (int i = 0; i < k; ++i) {
-        M_share_vec[i] = co_await secure_mpc_multiplication(
-            user_share[i], one_minus_dot_share, vmuls[k + i], peer_sock);
+    if (first > 0 && manifest.engine == ItemEngine::Stash) {
+        throw std::runtime_error("A stash-engine bundle cannot be resumed mid-run");
     }
-
-    // Step 3: Adjust the DPF final correction word
-    // Each server sends (M_b - FCW_b) to the other
-    std::cout << "  Adjusting DPF correction word...\n";
-
-    // For each dimension, we need to adjust the DPF
-    // We'll process all k dimensions
-    std::vector<uint64_t> adjusted_cwOut(k);
-
-    for (int dim = 0; dim < k; ++dim) {
-        uint64_t my_M = static_cast<uint64_t>(M_share_vec[dim]);
-        uint64_t my_FCW = dpf_key.cwOut;
-
-        // Compute my_M - my_FCW (in Z_2^64)
-        uint64_t my_diff = my_M - my_FCW;
-
-        // Exchange with peer
-        uint64_t peer_diff;
-#ifdef ROLE_p0
-        uint64_t my_diff_be = h2be64u(my_diff);
-        co_await boost::asio::async_write(peer_sock, boost::asio::buffer(&my_diff_be, sizeof(my_diff_be)), use_awaitable);
-
-        uint64_t peer_diff_be;
-        co_await boost::asio::async_read(peer_sock, boost::asio::buffer(&peer_diff_be, sizeof(peer_diff_be)), use_awaitable);
-        peer_diff = be2h64u(peer_diff_be);
-#else
-        uint64_t peer_diff_be;
-        co_await boost::asio::async_read(peer_sock, boost::asio::buffer(&peer_diff_be, sizeof(peer_diff_be)), use_awaitable);
-        peer_diff = be2h64u(peer_diff_be);
-
-        uint64_t my_diff_be = h2be64u(my_diff);
-        co_await boost::asio::async_write(peer_sock, boost::asio::buffer(&my_diff_be, sizeof(my_diff_be)), use_awaitable);
-#endif
-
-        // Compute adjusted FCW: FCWm = (M0 - FCW0) + (M1 - FCW1)
-        adjusted_cwOut[dim] = my_diff + peer_diff;
+    if (first > 0 && in_place) {
+        throw std::runtime_error("A bundle cannot be resumed mid-run on binary share matrices, which may hold "
+                                 "updates past its cursor; regenerate the data and deal a new bundle");
     }
+    for (std::size_t i = 0; i < first; ++i) {
+        co_await pool.take(i);
+        co_await prep.next_item_key(manifest.k, manifest.delta);
+    }
+    co_return first;
+}
 
-    // Step 4: Evaluate DPF with adjusted correction word and apply update
-    std::cout << "  Evaluating DPF and applying update...\n";
-
-    // Calculate nbits for domain size n_items
-    int nbits = 0;
-    uint64_t tmp = 1;
-    while (tmp < (uint64_t)n_items) { tmp <<= 1; ++nbits; }
-
-    // For each dimension, evaluate DPF and update item profiles
-    for (int dim = 0; dim < k; ++dim) {
-        // Create modified key with adjusted cwOut
-        DPFKey modified_key = dpf_key;
-        modified_key.cwOut = adjusted_cwOut[dim];
-
-        // Evaluate DPF over full domain
-        std::vector<uint64_t> dpf_output = evalFullDPF(modified_key, n_items, nbits);
+// Reads each query's preprocessing off the stream in query order and launches
+// the query; at a flush point waits for every query so far and persists U, V
+// and the bundle cursor
+static awaitable<void> dispatch_queries(OnlineQueries& online, QueryPipeline& pipeline, PrepPool& pool,
+                                        PrepReader& prep, const std::vector<std::vector<long long>>& queries,
+                                        const std::size_t first, const int flush_every, PrepBundle* bundle) {
+    const bool use_stash = online.items.prep.engine == ItemEngine::Stash;
+    if (use_stash && !queries.empty()) {
+        const StashShuffleShare shuffle = co_await prep.next_stash_shuffle(online.V_store.rows(), online.V_store.cols());
+        co_await stash_shuffle(online.V_store, online.link, PEER_SETUP, shuffle);
+    }
 
-        // Convert XOR shares to additive shares
-        // Insecure method: P0 negates its output
-        std::vector<long long> additive_update(n_items);
-        for (int i = 0; i < n_items; ++i) {
-            long long val = static_cast<long long>(dpf_output[i]);
-#ifdef ROLE_p0
-            additive_update[i] = -val; // P0 negates
-#else
-            additive_update[i] = val;  // P1 keeps as is
-#endif
+    for (std::size_t i = first; i < queries.size(); ++i) {
+        // The query's preprocessing, off the P2 stream in query order
+        QueryPrep qp = co_await pool.take(i);
+        const bool last = i + 1 == queries.size();
+        ItemMaterial mat;
+        if (use_stash) mat.stash_row = co_await prep.next_stash_row();
+        if (use_stash || online.V_store.rows() > 0) mat.key = co_await prep.next_item_key(online.items.prep.k, online.items.prep.delta);
+        if (use_stash && ((i + 1) % online.items.prep.epoch == 0 || last)) {
+            mat.shuffle = co_await prep.next_stash_shuffle(online.V_store.rows(), online.V_store.cols());
         }
 
-        // Update all item profiles for this dimension
-        for (int i = 0; i < n_items; ++i) {
-            random_vector item_i = read_row_from_matrix_file(V_path, i);
-            std::vector<long long> new_item(k);
-            for (int d = 0; d < k; ++d) {
-                if (d == dim) {
-                    new_item[d] = item_i[d] + additive_update[i];
-                } else {
-                    new_item[d] = item_i[d];
-                }
+        const bool flush_now = flush_every > 0 && (i + 1) % flush_every == 0;
+        std::cout << "\n=== Processing query #" << i << " ===\n";
+        auto body = [&online, &query = queries[i], i, qp = std::move(qp), mat = std::move(mat), flush_now, last]() mutable {
+            return run_query(online, query, static_cast<int>(i), std::move(qp), std::move(mat), flush_now, last);
+        };
+        if (!co_await pipeline.launch(std::move(body))) break;
+
+        // A flush persists exactly the queries up to this one, with the
+        // bundle cursor as one checkpoint. A stash-engine V is only in item
+        // order at the end of the run.
+        if (flush_now) {
+            co_await pipeline.drain();
+            if (bundle && use_stash) {
+                prep_checkpoint(*bundle, i + 1, {&online.U_store});
+            } else if (bundle) {
+                prep_checkpoint(*bundle, i + 1, {&online.U_store, &online.V_store});
+            } else {
+                online.U_store.flush();
+                if (!use_stash) online.V_store.flush();
             }
-            update_row_in_matrix_file(V_path, i, new_item);
         }
     }
+}
 
-    std::cout << "Item profile #" << item_idx << " updated successfully\n";
-    co_return;
+// Runs the queries from `first` on, several in flight over the multiplexed
+// peer link; returns once all of them have finished
+static awaitable<void> process_queries(tcp::socket& peer_sock, PrepPool& pool, PrepReader& prep,
+                                       const std::vector<std::vector<long long>>& queries, const std::size_t first,
+                                       ShareMatrix& U_store, ShareMatrix& V_store, ItemUpdates& items,
+                                       boost::asio::thread_pool& dpf_workers, const unsigned n_workers,
+                                       PrepBundle* bundle) {
+    PeerLink link(peer_sock);
+    link.start();
+    auto ex = co_await boost::asio::this_coro::executor;
+    // Per-user chains from the public user indices, the same at both parties
+    std::vector<uint64_t> users(queries.size());
+    for (std::size_t i = 0; i < queries.size(); ++i) users[i] = static_cast<uint64_t>(queries[i].at(0));
+    ChainTurnstile user_turn(ex, users, first);
+    Turnstile item_turn(ex, first);
+    std::cout << "Scheduling " << queries.size() - first << " queries by " << user_turn.chains() << " users ("
+              << user_turn.chained() << " wait on an earlier query by the same user)\n";
+    QueryPipeline pipeline(ex, pipeline_depth(), [&](std::exception_ptr e) {
+        link.abort(e);
+        user_turn.fail();
+        item_turn.fail();
+    });
+    OnlineQueries online{link, user_turn, item_turn, U_store, V_store, items, dpf_workers, n_workers};
+
+    std::exception_ptr error;
+    try {
+        co_await dispatch_queries(online, pipeline, pool, prep, queries, first, share_flush_interval(), bundle);
+        co_await pipeline.drain();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    if (error) {
+        // Fail whatever is still in flight and wait for it before unwinding
+        link.abort(error);
+        user_turn.fail();
+        item_turn.fail();
+        try {
+            co_await pipeline.drain();
+        } catch (...) {
+        }
+    }
+    co_await link.stop();
+    if (error) std::rethrow_exception(error);
 }
 
-// ----------------------- Main execution loop -----------------------
-awaitable<void> run(boost::asio::io_context& io_context) {
+
+// bundle: this party's offline preprocessing bundle, or null to receive the
+// preprocessing from P2
+awaitable<void> run(boost::asio::io_context& io_context, PrepBundle* bundle) {
     tcp::resolver resolver(io_context);
 
-    // Step 1: Connect to P2 and receive shares
-    std::cout << "Connecting to P2...\n";
-    tcp::socket server_sock = co_await setup_server_connection(io_context, resolver);
-    std::vector<DuAtAllahClient> received_shares;
-    std::vector<std::vector<DuAtAllahMultClient>> received_mul_shares;
-    co_await recv_all_shares_from_P2(server_sock, received_shares, received_mul_shares);
+    // Step 1: Start receiving shares from the bundle or from P2
+    tcp::socket server_sock(io_context);
+    if (bundle) {
+        std::cout << "Reading preprocessing from " << bundle->path() << " (" << bundle->cursor()
+                  << " queries consumed)\n";
+    } else {
+        std::cout << "Connecting to P2...\n";
+        server_sock = co_await setup_server_connection(io_context, resolver);
+    }
+    PrepReader prep = bundle ? PrepReader(bundle->frames(), bundle->length()) : PrepReader(server_sock);
+    PrepPool pool(prep, bundle ? nullptr : &server_sock, prep_window());
+    const PrepManifest manifest = co_await pool.start();
 
     std::cout << (
 #ifdef ROLE_p0
@@ -792,57 +1070,79 @@ awaitable<void> run(boost::asio::io_context& io_context) {
 #else
     "P1"
 #endif
-    ) << " finished receiving shares from P2\n";
+    ) << " received the manifest from P2 (" << manifest.queries << " queries)\n";
 
     // Step 2: Connect to peer
     std::cout << "Setting up peer connection...\n";
     tcp::socket peer_sock = co_await setup_peer_connection(io_context, resolver);
 
-    // Step 3: Preprocessing barrier
-    co_await barrier_prep(peer_sock);
-    std::cout << "Preprocessing complete, ready to process queries\n";
-
-    // Step 4: Read queries
+    // Step 3: Read queries
     auto queries = read_queries_file(query_path());
     std::cout << "Read " << queries.size() << " queries\n";
 
-    if (queries.size() > received_shares.size()) {
-        std::cerr << "Warning: queries (" << queries.size() << ") > shares (" << received_shares.size()
+    if (queries.size() > manifest.queries) {
+        std::cerr << "Warning: queries (" << queries.size() << ") > shares (" << manifest.queries
                   << "); truncating to available shares.\n";
-        queries.resize(received_shares.size());
+        queries.resize(manifest.queries);
     }
 
-    // Determine number of items (read from item matrix file)
-    int n_items = 0;
-    {
-        std::ifstream f(item_matrix_path());
-        if (f) {
-            int rows, cols;
-            f >> rows >> cols;
-            n_items = rows;
-        }
+    // Load both share matrices once; they stay resident for the whole run.
+    // Against a bundle they only ever take checkpointed state.
+    if (bundle) {
+        prep_recover_checkpoint(user_matrix_path(), bundle->cursor());
+        prep_recover_checkpoint(item_matrix_path(), bundle->cursor());
+    }
+    ShareMatrix U_store(user_matrix_path());
+    ShareMatrix V_store(item_matrix_path(), item_text_layout());
+    if (bundle) {
+        U_store.set_flush_on_close(false);
+        V_store.set_flush_on_close(false);
     }
-    std::cout << "Number of items in database: " << n_items << "\n";
 
-    // Step 5: Process queries
-    for (std::size_t i = 0; i < queries.size(); ++i) {
-        std::cout << "\n=== Processing query #" << i << " ===\n";
-        co_await barrier_query(peer_sock, static_cast<int>(i));
+    const std::size_t first = bundle ? co_await skip_consumed_queries(*bundle, prep, pool, manifest, queries.size(),
+                                                                      U_store.is_binary() || V_store.is_binary())
+                                     : 0;
 
-        // Assignment 1: User profile update
-        co_await update_user_profile_secure(queries[i], i, received_shares[i], 
-                                            received_mul_shares[i], peer_sock);
+    // Step 4: Preprocessing barrier
+    co_await barrier_prep(peer_sock, static_cast<int>(first));
+    std::cout << "Preprocessing barrier passed, ready to process queries";
+    if (first > 0) std::cout << " (resuming at query #" << first << ")";
+    std::cout << "\n";
 
-        // Assignment 3: Item profile update with DPF
-        if (n_items > 0) {
-            co_await update_item_profile_with_dpf(queries[i], i, received_shares[i],
-                                                  received_mul_shares[i], peer_sock,
-                                                  server_sock, n_items);
-        }
+    const int n_items = V_store.rows();
+    std::cout << "Number of items in database: " << n_items << "\n";
+    if (n_items > 0 && V_store.cols() != U_store.cols()) {
+        throw std::runtime_error("Dimension mismatch in item profile update");
+    }
 
-        std::cout << "Query #" << i << " completed\n";
+    // DPF evaluation runs on its own threads; this coroutine keeps the sockets
+    const unsigned n_workers = dpf_worker_threads();
+    boost::asio::thread_pool dpf_workers(n_workers);
+
+    // Item update engine P2 deals for; the stash engine starts its first epoch
+    // by permuting V. Item updates only change V and no query reads V, so the
+    // DPF engine can defer them and apply item_batch queries at a time.
+    ItemUpdates items;
+    items.prep = manifest;
+    items.batch = item_batch_size();
+    const bool use_stash = items.prep.engine == ItemEngine::Stash;
+    if (use_stash) {
+        if (n_items == 0 || items.prep.queries != queries.size() || items.prep.epoch == 0) {
+            throw std::runtime_error("Stash item engine does not match this run");
+        }
+        std::cout << "Stash item engine: " << items.prep.epoch << " queries per epoch\n";
     }
 
+    // Step 5: Process queries, several in flight over the multiplexed link
+    co_await process_queries(peer_sock, pool, prep, queries, first, U_store, V_store, items, dpf_workers, n_workers,
+                             bundle);
+
+    if (bundle) {
+        prep_checkpoint(*bundle, queries.size(), {&U_store, &V_store});
+    } else {
+        U_store.flush();
+        V_store.flush();
+    }
     std::cout << "\nAll queries processed successfully!\n";
     co_return;
 }
@@ -850,7 +1150,28 @@ awaitable<void> run(boost::asio::io_context& io_context) {
 int main() {
     std::cout.setf(std::ios::unitbuf); // auto-flush cout for Docker logs
     boost::asio::io_context io_context(1);
-    co_spawn(io_context, run(io_context), boost::asio::detached);
+    // Offline mode: P2 wrote this party's preprocessing to a bundle
+    std::optional<PrepBundle> bundle;
+    try {
+        if (prep_bundle_exists(prep_bundle_path())) bundle.emplace(prep_bundle_path(), prep_party());
+    } catch (std::exception& e) {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+    // Any error in the run (a used-up bundle, a peer out of step, ...) ends
+    // the client with a message and a non-zero status
+    int status = 0;
+    co_spawn(io_context, run(io_context, bundle ? &*bundle : nullptr), [&status](std::exception_ptr e) {
+        if (!e) return;
+        status = 1;
+        try {
+            std::rethrow_exception(e);
+        } catch (std::exception& x) {
+            std::cerr << "Exception: " << x.what() << "\n";
+        } catch (...) {
+            std::cerr << "Exception: unknown error\n";
+        }
+    });
     io_context.run();
-    return 0;
+    return status;
 }
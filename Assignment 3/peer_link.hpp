@@ -0,0 +1,311 @@
+#pragma once
+
+#include "common.hpp"
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// --- endian helpers (wire = big-endian) ---
+static inline long long h2be64(long long x){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(x);
+#else
+    return x;
+#endif
+}
+
+static inline long long be2h64(long long x){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(x);
+#else
+    return x;
+#endif
+}
+
+static inline int h2be32(int x){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap32(x);
+#else
+    return x;
+#endif
+}
+
+static inline int be2h32(int x){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap32(x);
+#else
+    return x;
+#endif
+}
+
+static inline uint16_t h2be16u(uint16_t x){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap16(x);
+#else
+    return x;
+#endif
+}
+
+static inline uint64_t h2be64u(uint64_t x){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(x);
+#else
+    return x;
+#endif
+}
+
+static inline uint64_t be2h64u(uint64_t x){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(x);
+#else
+    return x;
+#endif
+}
+
+// ----------------------- Multiplexed peer link -----------------------
+// Every P0 <-> P1 message of the online phase is a frame tagged with the query
+// it belongs to and the protocol step it carries, so several queries in
+// flight share the one socket:
+//
+//   u32 query, u16 step, u32 words, then that many int64 words (all big-endian)
+//
+// Both parties send a query's messages in the same order and frames of one
+// query arrive in the order they were sent, so recv(query, step) returns the
+// next frame of that query, whatever arrived for other queries meanwhile. A
+// frame for another step than the one expected means the parties are out of
+// step, and the receiver fails instead of combining unrelated shares; no
+// barrier round trip per query is needed to keep them in lockstep.
+//
+// The link aggregates rounds across the queries in flight. send() only queues
+// a frame; one writer coroutine sends the queue once per tick of the
+// io_context, i.e. after every coroutine that was ready has run and queued
+// its own openings, so the multiplications, dot products and correction
+// words of all queries at the same step leave in one write. The reader reads
+// whatever has arrived in one go, files every complete frame in it under its
+// query and then wakes the waiters, each of which takes its own slice.
+// Messages that belong to no query (the first stash shuffle) use PEER_SETUP.
+static constexpr uint32_t PEER_SETUP = 0xffffffffu;
+static constexpr std::size_t PEER_HEADER_BYTES = 10;
+static constexpr uint32_t PEER_MAX_WORDS = 1u << 28;
+static constexpr std::size_t PEER_READ_BYTES = 1 << 16;
+
+// What a frame carries, in the order a query sends them
+enum class PeerStep : uint16_t {
+    DotProduct = 1,    // [X + u | Y + v]
+    Multiply = 2,      // interleaved (a_i + x_i, b_i + y_i)
+    ItemDelta = 3,     // d = M - r
+    StashShuffle0 = 4, // X1 - a, P1 -> P0
+    StashShuffle1 = 5, // Y0 - a', P0 -> P1
+};
+
+static inline const char* peer_step_name(uint16_t step) {
+    switch (static_cast<PeerStep>(step)) {
+    case PeerStep::DotProduct: return "dot product";
+    case PeerStep::Multiply: return "multiplication";
+    case PeerStep::ItemDelta: return "item delta";
+    case PeerStep::StashShuffle0: return "stash shuffle (first half)";
+    case PeerStep::StashShuffle1: return "stash shuffle (second half)";
+    }
+    return "unknown step";
+}
+
+class PeerLink {
+public:
+    explicit PeerLink(tcp::socket& sock)
+        : sock_(sock), signal_(sock.get_executor(), boost::asio::steady_timer::time_point::max()) {}
+
+    PeerLink(const PeerLink&) = delete;
+    PeerLink& operator=(const PeerLink&) = delete;
+
+    // Starts the reader. The link batches its own writes, so Nagle's delay
+    // would only hold back the last frame of every burst.
+    void start() {
+        sock_.set_option(tcp::no_delay(true));
+        reading_ = true;
+        co_spawn(sock_.get_executor(), reader(), boost::asio::detached);
+    }
+
+    void send(uint32_t query, PeerStep step, const std::vector<long long>& words) {
+        if (error_) std::rethrow_exception(error_);
+        if (words.size() > PEER_MAX_WORDS) throw std::runtime_error("Peer message too large");
+        const uint32_t q = static_cast<uint32_t>(h2be32(static_cast<int>(query)));
+        const uint16_t st = h2be16u(static_cast<uint16_t>(step));
+        const uint32_t n = static_cast<uint32_t>(h2be32(static_cast<int>(words.size())));
+        const std::size_t at = out_.size();
+        out_.resize(at + PEER_HEADER_BYTES + words.size() * 8);
+        char* p = out_.data() + at;
+        std::memcpy(p, &q, 4);
+        std::memcpy(p + 4, &st, 2);
+        std::memcpy(p + 6, &n, 4);
+        p += PEER_HEADER_BYTES;
+        for (long long w : words) {
+            w = h2be64(w);
+            std::memcpy(p, &w, 8);
+            p += 8;
+        }
+        ++queued_;
+        if (!writing_) {
+            writing_ = true;
+            co_spawn(sock_.get_executor(), writer(), [this](std::exception_ptr e) {
+                writing_ = false;
+                if (e) abort(e);
+                notify();
+            });
+        }
+    }
+
+    // The next message of `query`, which must be for `step`
+    awaitable<std::vector<long long>> recv(uint32_t query, PeerStep step) {
+        for (;;) {
+            auto it = inbox_.find(query);
+            if (it != inbox_.end()) {
+                PeerFrame f = std::move(it->second.front());
+                it->second.pop_front();
+                if (it->second.empty()) inbox_.erase(it);
+                if (f.step != static_cast<uint16_t>(step)) {
+                    throw std::runtime_error("Peer is out of step at query " + std::to_string(query) + ": expected " +
+                                             peer_step_name(static_cast<uint16_t>(step)) + ", got " +
+                                             peer_step_name(f.step));
+                }
+                co_return std::move(f.words);
+            }
+            if (error_) std::rethrow_exception(error_);
+            co_await wait();
+        }
+    }
+
+    // Sends `mine` and returns the peer's message of the same length; both
+    // parties send first, so this is one one-way latency, not two
+    awaitable<std::vector<long long>> exchange(uint32_t query, PeerStep step, const std::vector<long long>& mine) {
+        send(query, step, mine);
+        std::vector<long long> peer = co_await recv(query, step);
+        if (peer.size() != mine.size()) throw std::runtime_error("Peer message has the wrong length");
+        co_return peer;
+    }
+
+    // Fails every pending and later call, e.g. after an error elsewhere
+    void abort(std::exception_ptr e) {
+        if (!error_) error_ = e;
+        boost::system::error_code ec;
+        sock_.cancel(ec);
+        notify();
+    }
+
+    // Writes out what is queued and stops the reader; the link must be
+    // stopped before it goes away. Safe at any point, even before the reader
+    // has issued its first read (a run with no queries).
+    awaitable<void> stop() {
+        while (writing_) co_await wait();
+        closing_ = true;
+        boost::system::error_code ec;
+        sock_.cancel(ec);
+        while (reading_) co_await wait();
+        std::cout << "Peer link: " << frames_sent_ << " frames in " << writes_ << " writes, " << frames_received_
+                  << " frames in " << reads_ << " reads\n";
+    }
+
+private:
+    awaitable<void> wait() {
+        boost::system::error_code ec;
+        co_await signal_.async_wait(boost::asio::redirect_error(use_awaitable, ec));
+    }
+
+    // Wakes every waiter; each rechecks what it waits for. The io_context is
+    // single-threaded, so nothing can change between a check and its wait.
+    void notify() { signal_.cancel(); }
+
+    // One write per tick: the post lets every coroutine that is ready run
+    // first, so the write carries what they queue too
+    awaitable<void> writer() {
+        std::vector<char> buf;
+        for (;;) {
+            co_await boost::asio::post(sock_.get_executor(), use_awaitable);
+            if (out_.empty() || error_) break;
+            buf.swap(out_);
+            frames_sent_ += queued_;
+            queued_ = 0;
+            ++writes_;
+            co_await boost::asio::async_write(sock_, boost::asio::buffer(buf), use_awaitable);
+            buf.clear();
+        }
+    }
+
+    awaitable<void> reader() {
+        // in[head, tail) holds bytes read but not yet filed
+        std::vector<char> in(PEER_READ_BYTES);
+        std::size_t head = 0, tail = 0;
+        try {
+            // A cancel only reaches a read in progress, so the reader checks
+            // closing_ before each read it starts
+            while (!closing_) {
+                if (head > 0 && (tail - head < PEER_HEADER_BYTES || in.size() - tail < PEER_READ_BYTES / 4)) {
+                    std::memmove(in.data(), in.data() + head, tail - head);
+                    tail -= head;
+                    head = 0;
+                }
+                if (tail == in.size()) in.resize(in.size() * 2); // a frame larger than the buffer
+                tail += co_await sock_.async_read_some(boost::asio::buffer(in.data() + tail, in.size() - tail),
+                                                       use_awaitable);
+                ++reads_;
+
+                bool filed = false;
+                while (tail - head >= PEER_HEADER_BYTES) {
+                    const char* p = in.data() + head;
+                    uint32_t query, n;
+                    uint16_t step;
+                    std::memcpy(&query, p, 4);
+                    std::memcpy(&step, p + 4, 2);
+                    std::memcpy(&n, p + 6, 4);
+                    query = static_cast<uint32_t>(be2h32(static_cast<int>(query)));
+                    step = h2be16u(step);
+                    n = static_cast<uint32_t>(be2h32(static_cast<int>(n)));
+                    if (n > PEER_MAX_WORDS) throw std::runtime_error("Peer frame too large");
+                    const std::size_t bytes = PEER_HEADER_BYTES + std::size_t(n) * 8;
+                    if (tail - head < bytes) {
+                        if (in.size() < bytes) in.resize(bytes);
+                        break;
+                    }
+                    PeerFrame f{step, std::vector<long long>(n)};
+                    std::memcpy(f.words.data(), p + PEER_HEADER_BYTES, std::size_t(n) * 8);
+                    for (long long& w : f.words) w = be2h64(w);
+                    inbox_[query].push_back(std::move(f));
+                    head += bytes;
+                    ++frames_received_;
+                    filed = true;
+                }
+                if (head == tail) head = tail = 0;
+                if (filed) notify();
+            }
+        } catch (...) {
+            // The peer hung up or stop() cancelled the read; a recv still
+            // waiting for a frame fails with this
+            if (!closing_ && !error_) error_ = std::current_exception();
+        }
+        reading_ = false;
+        notify();
+    }
+
+    struct PeerFrame {
+        uint16_t step;
+        std::vector<long long> words;
+    };
+
+    tcp::socket& sock_;
+    boost::asio::steady_timer signal_;
+    std::map<uint32_t, std::deque<PeerFrame>> inbox_;
+    std::vector<char> out_;
+    bool writing_ = false, reading_ = false, closing_ = false;
+    uint64_t queued_ = 0, frames_sent_ = 0, writes_ = 0, frames_received_ = 0, reads_ = 0;
+    std::exception_ptr error_;
+};
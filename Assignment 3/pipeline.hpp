@@ -0,0 +1,168 @@
+#pragma once
+
+#include "common.hpp"
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// ----------------------- Query pipeline -----------------------
+// The online phase keeps several queries in flight on the io_context, each a
+// coroutine talking over the multiplexed peer link (peer_link.hpp), so one
+// query's round trips overlap another's local work. Parts of a query that
+// must see the queries in order pass through a stage: a Turnstile when every
+// query conflicts with the one before it (adding to V), a ChainTurnstile when
+// only queries with the same key do (reading and writing one U row). The rest
+// of the queries run concurrently.
+
+// Queries in flight, from MPC_PIPELINE_DEPTH (default 8; 1 runs them one at a time)
+static inline std::size_t pipeline_depth() {
+    const char* env = std::getenv("MPC_PIPELINE_DEPTH");
+    int n = (env && *env) ? std::atoi(env) : 0;
+    return n > 0 ? static_cast<std::size_t>(n) : 8;
+}
+
+// Wakes every waiter when notified; each rechecks its own condition. The
+// io_context is single-threaded, so nothing changes between a check and the wait.
+class PipelineSignal {
+public:
+    explicit PipelineSignal(const boost::asio::any_io_executor& ex)
+        : timer_(ex, boost::asio::steady_timer::time_point::max()) {}
+
+    awaitable<void> wait() {
+        boost::system::error_code ec;
+        co_await timer_.async_wait(boost::asio::redirect_error(use_awaitable, ec));
+    }
+
+    void notify() { timer_.cancel(); }
+
+    boost::asio::any_io_executor get_executor() { return timer_.get_executor(); }
+
+private:
+    boost::asio::steady_timer timer_;
+};
+
+// An in-order stage: enter(t) returns once tickets first .. t - 1 have left
+class Turnstile {
+public:
+    Turnstile(const boost::asio::any_io_executor& ex, uint64_t first) : signal_(ex), next_(first) {}
+
+    awaitable<void> enter(uint64_t ticket) {
+        while (next_ != ticket) {
+            if (failed_) throw std::runtime_error("Query pipeline aborted");
+            co_await signal_.wait();
+        }
+    }
+
+    void leave() {
+        ++next_;
+        signal_.notify();
+    }
+
+    void fail() {
+        failed_ = true;
+        signal_.notify();
+    }
+
+private:
+    PipelineSignal signal_;
+    uint64_t next_;
+    bool failed_ = false;
+};
+
+// An in-order stage per key: enter(t) returns once the previous ticket with
+// the same key has left, so tickets with different keys pass in any order.
+// The chains are built up front from the key of every ticket, so parties that
+// see the same keys agree on them; tickets before `first` count as done.
+class ChainTurnstile {
+public:
+    ChainTurnstile(const boost::asio::any_io_executor& ex, const std::vector<uint64_t>& keys, uint64_t first)
+        : signal_(ex), prev_(keys.size(), NONE), done_(keys.size(), false) {
+        std::unordered_map<uint64_t, uint64_t> last;
+        for (uint64_t t = first; t < keys.size(); ++t) {
+            auto [it, fresh] = last.try_emplace(keys[t], t);
+            if (!fresh) {
+                prev_[t] = it->second;
+                it->second = t;
+                ++chained_;
+            }
+        }
+        chains_ = last.size();
+    }
+
+    awaitable<void> enter(uint64_t ticket) {
+        const uint64_t prev = prev_.at(ticket);
+        while (prev != NONE && !done_[prev]) {
+            if (failed_) throw std::runtime_error("Query pipeline aborted");
+            co_await signal_.wait();
+        }
+    }
+
+    void leave(uint64_t ticket) {
+        done_.at(ticket) = true;
+        signal_.notify();
+    }
+
+    void fail() {
+        failed_ = true;
+        signal_.notify();
+    }
+
+    std::size_t chains() const { return chains_; }   // distinct keys
+    std::size_t chained() const { return chained_; } // tickets that wait on an earlier one
+
+private:
+    static constexpr uint64_t NONE = ~uint64_t(0);
+    PipelineSignal signal_;
+    std::vector<uint64_t> prev_;
+    std::vector<bool> done_;
+    std::size_t chains_ = 0, chained_ = 0;
+    bool failed_ = false;
+};
+
+// Runs query coroutines, at most depth at a time. The first error is kept,
+// on_error is called once so the queries still waiting can be failed, no
+// more queries are launched, and drain() rethrows it.
+class QueryPipeline {
+public:
+    QueryPipeline(const boost::asio::any_io_executor& ex, std::size_t depth, std::function<void(std::exception_ptr)> on_error)
+        : signal_(ex), depth_(depth), on_error_(std::move(on_error)) {}
+
+    // Starts body() once a slot is free; false if an earlier query failed
+    template <typename F>
+    awaitable<bool> launch(F body) {
+        while (in_flight_ >= depth_ && !error_) co_await signal_.wait();
+        if (error_) co_return false;
+        ++in_flight_;
+        co_spawn(signal_.get_executor(), std::move(body), [this](std::exception_ptr e) {
+            --in_flight_;
+            if (e && !error_) {
+                error_ = e;
+                on_error_(e);
+            }
+            signal_.notify();
+        });
+        co_return true;
+    }
+
+    // Waits for every query in flight
+    awaitable<void> drain() {
+        while (in_flight_ > 0) co_await signal_.wait();
+        if (error_) std::rethrow_exception(error_);
+    }
+
+private:
+    PipelineSignal signal_;
+    const std::size_t depth_;
+    std::size_t in_flight_ = 0;
+    std::exception_ptr error_;
+    std::function<void(std::exception_ptr)> on_error_;
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "common.hpp"
+#include "share_store.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ----------------------- Offline preprocessing bundles -----------------------
+// With MPC_PREP_MODE=offline, P2 writes each client's preprocessing to a file
+// instead of a socket: a 32-byte header, then exactly the prep_wire.hpp frames
+// it would have sent. A client that finds its bundle mmaps it and reads the
+// frames from memory, so it starts without P2. The header keeps a cursor of
+// the queries whose material has been consumed; the client advances it when
+// it checkpoints its share matrices, and a restarted client resumes after it.
+//
+//   "PBND", u32 version=1, u32 party, u32 reserved, u64 frame bytes, u64 cursor
+static constexpr char PREP_BUNDLE_MAGIC[4] = {'P', 'B', 'N', 'D'};
+static constexpr uint32_t PREP_BUNDLE_VERSION = 1;
+
+struct PrepBundleHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t party;
+    uint32_t reserved;
+    uint64_t length;
+    uint64_t cursor;
+};
+static_assert(sizeof(PrepBundleHeader) == 32, "preprocessing bundle header must be 32 bytes");
+
+// Where P2 deals to, from MPC_PREP_MODE=online|offline (default online)
+static inline bool prep_offline_from_env(){
+    const char* env = std::getenv("MPC_PREP_MODE");
+    if (!env || !*env || std::strcmp(env, "online") == 0) return false;
+    if (std::strcmp(env, "offline") == 0) return true;
+    throw std::runtime_error(std::string("Unknown MPC_PREP_MODE: ") + env);
+}
+
+static inline bool prep_bundle_exists(const char* path){
+    struct stat st{};
+    return ::stat(path, &st) == 0;
+}
+
+// ----------------------- Writing (P2) -----------------------
+// One client's bundle; frames are appended through out() and close() fills in
+// their total length
+class PrepBundleWriter {
+public:
+    PrepBundleWriter(std::string path, uint32_t party) : path_(std::move(path)), out_(path_, std::ios::binary) {
+        if (!out_) throw std::runtime_error("Failed to open " + path_);
+        PrepBundleHeader h{};
+        std::memcpy(h.magic, PREP_BUNDLE_MAGIC, sizeof(h.magic));
+        h.version = PREP_BUNDLE_VERSION;
+        h.party = party;
+        out_.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    }
+
+    std::ostream& out() { return out_; }
+
+    void close() {
+        const uint64_t length = static_cast<uint64_t>(out_.tellp()) - sizeof(PrepBundleHeader);
+        out_.seekp(offsetof(PrepBundleHeader, length));
+        out_.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        out_.close();
+        if (!out_) throw std::runtime_error("Write failed for " + path_);
+    }
+
+private:
+    std::string path_;
+    std::ofstream out_;
+};
+
+// ----------------------- Reading (P0/P1) -----------------------
+// A client's bundle, mmapped for the whole run. The frames are read in place
+// (PrepReader over frames()/length()); only the cursor is ever written.
+class PrepBundle {
+public:
+    // The header is checked before the file is mapped, so a bad bundle never
+    // leaves a mapping behind
+    PrepBundle(std::string path, uint32_t party) : path_(std::move(path)) {
+        int fd = ::open(path_.c_str(), O_RDWR);
+        if (fd < 0) throw std::runtime_error("Failed to open " + path_);
+        struct stat st{};
+        PrepBundleHeader h;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(h) || ::pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+            ::close(fd);
+            throw std::runtime_error("Bad header in " + path_);
+        }
+        std::string bad;
+        if (std::memcmp(h.magic, PREP_BUNDLE_MAGIC, sizeof(h.magic)) != 0 || h.version != PREP_BUNDLE_VERSION) {
+            bad = "Not a preprocessing bundle: " + path_;
+        } else if (h.party != party) {
+            bad = "Preprocessing bundle " + path_ + " is for another party";
+        } else if (static_cast<uint64_t>(st.st_size) != sizeof(h) + h.length) {
+            bad = "Preprocessing bundle size does not match header in " + path_;
+        }
+        if (!bad.empty()) {
+            ::close(fd);
+            throw std::runtime_error(bad);
+        }
+
+        map_len_ = static_cast<size_t>(st.st_size);
+        void* p = mmap(nullptr, map_len_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error("mmap failed for " + path_);
+        map_ = p;
+    }
+
+    PrepBundle(const PrepBundle&) = delete;
+    PrepBundle& operator=(const PrepBundle&) = delete;
+
+    ~PrepBundle() { if (map_) munmap(map_, map_len_); }
+
+    const char* frames() const { return static_cast<const char*>(map_) + sizeof(PrepBundleHeader); }
+    size_t length() const { return header().length; }
+    uint64_t cursor() const { return header().cursor; }
+    const std::string& path() const { return path_; }
+
+    // Marks the material of the first `queries` queries as consumed, on disk
+    void consume(uint64_t queries) {
+        header().cursor = queries;
+        if (msync(map_, sizeof(PrepBundleHeader), MS_SYNC) != 0) throw std::runtime_error("msync failed for " + path_);
+    }
+
+private:
+    PrepBundleHeader& header() const { return *static_cast<PrepBundleHeader*>(map_); }
+
+    std::string path_;
+    void* map_ = nullptr;
+    size_t map_len_ = 0;
+};
+
+// ----------------------- Checkpoints (P0/P1) -----------------------
+// The cursor and a text share matrix move together: the matrix is saved next
+// to itself as "<path>.ckpt<cursor>", the cursor is advanced, and only then is
+// the saved copy renamed into place. A client that stopped anywhere in
+// between finishes or drops the copy against the cursor on restart
+// (prep_recover_checkpoint), so U and V always hold exactly the queries
+// before the cursor. Binary matrices are written in place between
+// checkpoints, so a run on them can only be repeated from a fresh bundle.
+inline std::string prep_checkpoint_path(const std::string& matrix_path, uint64_t cursor) {
+    return matrix_path + ".ckpt" + std::to_string(cursor);
+}
+
+// Persists `matrices` as of the first `queries` queries, then the cursor
+inline void prep_checkpoint(PrepBundle& bundle, uint64_t queries, std::initializer_list<ShareMatrix*> matrices) {
+    for (ShareMatrix* m : matrices) {
+        if (m->is_binary()) m->flush();
+        else m->save_text(prep_checkpoint_path(m->path(), queries));
+    }
+    bundle.consume(queries);
+    for (ShareMatrix* m : matrices) {
+        if (!m->is_binary()) m->replace_with(prep_checkpoint_path(m->path(), queries));
+    }
+}
+
+// Before the matrix at `matrix_path` is loaded: moves in the copy saved for
+// `cursor`, if its rename was cut short, and deletes copies from checkpoints
+// that never reached the cursor
+inline void prep_recover_checkpoint(const std::string& matrix_path, uint64_t cursor) {
+    namespace fs = std::filesystem;
+    const fs::path path(matrix_path);
+    const std::string committed = prep_checkpoint_path(path.filename().string(), cursor);
+    const std::string prefix = path.filename().string() + ".ckpt";
+    const fs::path dir = path.has_parent_path() ? path.parent_path() : fs::path(".");
+    std::vector<fs::path> saved;
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(dir, ec)) {
+        if (entry.path().filename().string().rfind(prefix, 0) == 0) saved.push_back(entry.path());
+    }
+    for (const fs::path& p : saved) {
+        if (p.filename() == committed) fs::rename(p, path);
+        else fs::remove(p);
+    }
+}
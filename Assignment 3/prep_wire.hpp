@@ -0,0 +1,466 @@
+#pragma once
+
+#include "common.hpp"
+#include "item_stash.hpp"
+#include "prg.hpp"
+#include <boost/asio/read.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// ----------------------- P2 -> client preprocessing frames -----------------------
+// Everything P2 deals travels as frames: a 24-byte header, then `length`
+// payload bytes. Header fields and payload words are little-endian (host
+// order, as in the binary share matrices), so runs of words are copied in
+// and out in bulk.
+//
+//   Manifest      u32 queries, u32 k, u32 triples per query, u8 item engine, u32 stash epoch,
+//                 u8 randomness (explicit or seeded), u8 item delta (open or fused)
+//   Correlations  count queries of width k: X[k], Y[k], z as int64 each
+//   Triples       count queries of width t: t x (x, y, z) as int64
+//   SeededCorrelations / SeededTriples
+//                 the same records expanded from a seed: u64 seed, u32 z count,
+//                 then either nothing or every record's z as int64
+//   ItemKeys      count keys of width k: a DPF key (see prep_put_dpf_key), then r[k] as u64
+//                 (open item delta) or x[k], y as u64 (fused)
+//   StashRow      u32 row revealed by the next query
+//   StashShuffle  width k: u32 rows, rows x u32 perm, rows*k x u64 w, u64 seed_a, u64 seed_c
+//   Hello         client -> P2: u32 party (0 or 1), the first frame on the connection
+//   Refill        client -> P2: u64 queries, how many queries' material the client wants in total
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "preprocessing frames are little-endian");
+
+static constexpr char PREP_FRAME_MAGIC[4] = {'P', 'R', 'E', 'P'};
+static constexpr uint16_t PREP_FRAME_VERSION = 2;
+
+enum class PrepFrameType : uint16_t {
+    Manifest = 1,
+    Correlations = 2,
+    Triples = 3,
+    ItemKeys = 4,
+    StashRow = 5,
+    StashShuffle = 6,
+    Hello = 7,
+    SeededCorrelations = 8,
+    SeededTriples = 9,
+    Refill = 10,
+};
+
+struct PrepFrameHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t type;
+    uint32_t count;  // records in the payload
+    uint32_t width;  // words (or k) per record
+    uint64_t length; // payload bytes
+};
+static_assert(sizeof(PrepFrameHeader) == 24, "preprocessing frame header must be 24 bytes");
+
+// ----------------------- Seeded correlated randomness -----------------------
+// Explicit: every random mask travels in full to both clients.
+// Seeded:   each frame carries one seed per client, and the client expands its
+//           X, Y, x, y (and P0 its z) locally. Only P1 gets explicit z values,
+//           z1 = x0*y1 + x1*y0 - z0, as those depend on both seeds. A client
+//           can rebuild its material from the seeds and z values alone.
+enum class PrepRandomness : uint8_t { Explicit = 0, Seeded = 1 };
+
+// Randomness P2 deals, from MPC_PREP_RANDOMNESS=explicit|seeded (default explicit)
+static inline PrepRandomness prep_randomness_from_env(){
+    const char* env = std::getenv("MPC_PREP_RANDOMNESS");
+    if (!env || !*env || std::strcmp(env, "explicit") == 0) return PrepRandomness::Explicit;
+    if (std::strcmp(env, "seeded") == 0) return PrepRandomness::Seeded;
+    throw std::runtime_error(std::string("Unknown MPC_PREP_RANDOMNESS: ") + env);
+}
+
+static constexpr uint64_t C_PREP = 0x9696969696969696ull;
+
+// Word i of a seeded stream, in [-UPPER_LIM, UPPER_LIM] like random_vector
+static inline long long prep_seeded_word(uint64_t seed, uint64_t i){
+    return static_cast<long long>(smix(seed ^ (C_PREP + i)) % (2 * UPPER_LIM + 1)) - UPPER_LIM;
+}
+
+// Record j of a seeded correlation frame: words X[k], Y[k], z
+static inline DuAtAllahClient prep_seeded_correlation(uint64_t seed, uint64_t j, size_t k){
+    DuAtAllahClient s(static_cast<int>(k));
+    const uint64_t base = j * (2 * k + 1);
+    for (size_t d = 0; d < k; ++d) {
+        s.X[d] = prep_seeded_word(seed, base + d);
+        s.Y[d] = prep_seeded_word(seed, base + k + d);
+    }
+    s.z = prep_seeded_word(seed, base + 2 * k);
+    return s;
+}
+
+// Triple t of record j in a seeded triple frame of the given width: words x, y, z
+static inline DuAtAllahMultClient prep_seeded_triple(uint64_t seed, uint64_t j, size_t width, size_t t){
+    DuAtAllahMultClient m;
+    const uint64_t base = (j * width + t) * 3;
+    m.x = prep_seeded_word(seed, base);
+    m.y = prep_seeded_word(seed, base + 1);
+    m.z = prep_seeded_word(seed, base + 2);
+    return m;
+}
+
+// ----------------------- Item delta -----------------------
+// How a query's item delta M = u * (1 - <u, v>) reaches its DPF.
+// Open:  the DPF has payload (r, 1), k + 1 words per point; the clients
+//        compute shares of M with k more triples, then open d = M - r in an
+//        extra exchange.
+// Fused: the DPF has payload (x, x*y, y, 1), 2k + 2 words per point, and the
+//        clients hold shares of x[k] and y. The multiplication round opens
+//        X = u + x and Y = (1 - <u, v>) + y, and
+//        M = X*Y - X*y - Y*x + x*y is then linear in the DPF outputs. The
+//        item update needs no exchange of its own, at twice the output words.
+enum class ItemDelta : uint8_t { Open = 0, Fused = 1 };
+
+// From MPC_ITEM_DELTA=open|fused (default open)
+static inline ItemDelta item_delta_from_env(){
+    const char* env = std::getenv("MPC_ITEM_DELTA");
+    if (!env || !*env || std::strcmp(env, "open") == 0) return ItemDelta::Open;
+    if (std::strcmp(env, "fused") == 0) return ItemDelta::Fused;
+    throw std::runtime_error(std::string("Unknown MPC_ITEM_DELTA: ") + env);
+}
+
+// Output words per point of an item DPF
+static inline size_t item_dpf_width(size_t k, ItemDelta delta){
+    return delta == ItemDelta::Fused ? 2 * k + 2 : k + 1;
+}
+
+// What P2 deals for, sent before anything else
+struct PrepManifest {
+    uint32_t queries = 0;
+    uint32_t k = 0;
+    uint32_t triples_per_query = 0;
+    ItemEngine engine = ItemEngine::DPF;
+    uint32_t epoch = 0; // queries per stash epoch
+    PrepRandomness randomness = PrepRandomness::Explicit;
+    ItemDelta delta = ItemDelta::Open;
+};
+
+// ----------------------- Writing (P2) -----------------------
+template <typename T>
+inline void prep_put(std::string& out, const T& v) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    out.append(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+template <typename T>
+inline void prep_put_words(std::string& out, const T* p, size_t n) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    out.append(reinterpret_cast<const char*>(p), n * sizeof(T));
+}
+
+// Appends a frame header and returns its offset; prep_end_frame fills in the
+// payload length once the payload has been appended after it
+inline size_t prep_begin_frame(std::string& out, PrepFrameType type, uint32_t count = 1, uint32_t width = 0) {
+    PrepFrameHeader h{};
+    std::memcpy(h.magic, PREP_FRAME_MAGIC, sizeof(h.magic));
+    h.version = PREP_FRAME_VERSION;
+    h.type = static_cast<uint16_t>(type);
+    h.count = count;
+    h.width = width;
+    const size_t at = out.size();
+    prep_put(out, h);
+    return at;
+}
+
+inline void prep_end_frame(std::string& out, size_t at) {
+    const uint64_t length = out.size() - at - sizeof(PrepFrameHeader);
+    std::memcpy(out.data() + at + offsetof(PrepFrameHeader, length), &length, sizeof(length));
+}
+
+inline void prep_put_manifest(std::string& out, const PrepManifest& m) {
+    const size_t at = prep_begin_frame(out, PrepFrameType::Manifest);
+    prep_put(out, m.queries);
+    prep_put(out, m.k);
+    prep_put(out, m.triples_per_query);
+    prep_put(out, static_cast<uint8_t>(m.engine));
+    prep_put(out, m.epoch);
+    prep_put(out, static_cast<uint8_t>(m.randomness));
+    prep_put(out, static_cast<uint8_t>(m.delta));
+    prep_end_frame(out, at);
+}
+
+// A seeded frame; z holds every record's explicit z, or is empty
+inline void prep_put_seeded(std::string& out, PrepFrameType type, uint32_t count, uint32_t width, uint64_t seed,
+                            const std::vector<long long>& z) {
+    const size_t at = prep_begin_frame(out, type, count, width);
+    prep_put(out, seed);
+    prep_put(out, static_cast<uint32_t>(z.size()));
+    prep_put_words(out, z.data(), z.size());
+    prep_end_frame(out, at);
+}
+
+// u64 s0, u8 t0, u8 prg, u8 leaf_bits, u32 cws, cws x (u64 dSL, u64 dSR, u8 dTL,
+// u8 dTR), u32 output words, that many u64 cwOuts
+inline void prep_put_dpf_key(std::string& out, const DPFKey& key) {
+    prep_put(out, key.s0);
+    prep_put(out, static_cast<uint8_t>(key.t0 ? 1 : 0));
+    prep_put(out, key.prg);
+    prep_put(out, key.leaf_bits);
+    prep_put(out, static_cast<uint32_t>(key.cws.size()));
+    for (const auto& cw : key.cws) {
+        prep_put(out, cw.dSL);
+        prep_put(out, cw.dSR);
+        prep_put(out, static_cast<uint8_t>(cw.dTL ? 1 : 0));
+        prep_put(out, static_cast<uint8_t>(cw.dTR ? 1 : 0));
+    }
+    prep_put(out, static_cast<uint32_t>(key.cwOuts.size()));
+    prep_put_words(out, key.cwOuts.data(), key.cwOuts.size());
+}
+
+inline void prep_put_stash_shuffle(std::string& out, const StashShuffleShare& share, uint32_t k) {
+    const size_t at = prep_begin_frame(out, PrepFrameType::StashShuffle, 1, k);
+    prep_put(out, static_cast<uint32_t>(share.perm.size()));
+    prep_put_words(out, share.perm.data(), share.perm.size());
+    prep_put_words(out, share.w.data(), share.w.size());
+    prep_put(out, share.seed_a);
+    prep_put(out, share.seed_c);
+    prep_end_frame(out, at);
+}
+
+// Which client this is; P2 routes each party's half of the material by it,
+// not by the order the clients connect in
+inline void prep_put_hello(std::string& out, uint32_t party) {
+    const size_t at = prep_begin_frame(out, PrepFrameType::Hello);
+    prep_put(out, party);
+    prep_end_frame(out, at);
+}
+
+// Credit for P2 to send the material of the first `queries` queries
+inline void prep_put_refill(std::string& out, uint64_t queries) {
+    const size_t at = prep_begin_frame(out, PrepFrameType::Refill);
+    prep_put(out, queries);
+    prep_end_frame(out, at);
+}
+
+// ----------------------- Reading (P0/P1) -----------------------
+// Cursor over one frame's payload; running past its end means a malformed frame
+class PrepPayload {
+public:
+    PrepPayload(const PrepFrameHeader& h, const char* data) : header(h), p_(data), end_(data + h.length) {}
+
+    template <typename T>
+    T get() {
+        T v;
+        get_words(&v, 1);
+        return v;
+    }
+
+    template <typename T>
+    void get_words(T* dst, size_t n) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (n > static_cast<size_t>(end_ - p_) / sizeof(T)) throw std::runtime_error("Truncated preprocessing frame");
+        std::memcpy(dst, p_, n * sizeof(T));
+        p_ += n * sizeof(T);
+    }
+
+    void expect_end() const {
+        if (p_ != end_) throw std::runtime_error("Trailing bytes in preprocessing frame");
+    }
+
+    const PrepFrameHeader header;
+
+private:
+    const char* p_;
+    const char* end_;
+};
+
+inline DPFKey prep_get_dpf_key(PrepPayload& in) {
+    DPFKey key;
+    key.s0 = in.get<uint64_t>();
+    key.t0 = in.get<uint8_t>() != 0;
+    key.prg = in.get<uint8_t>();
+    if (key.prg != static_cast<uint8_t>(PRGKind::SMix) && key.prg != static_cast<uint8_t>(PRGKind::AES)) {
+        throw std::runtime_error("DPF key uses an unknown PRG");
+    }
+    key.leaf_bits = in.get<uint8_t>();
+    if (key.leaf_bits > 32) throw std::runtime_error("DPF key has too many packed leaf levels");
+
+    const uint32_t num_cws = in.get<uint32_t>();
+    if (num_cws > 64) throw std::runtime_error("DPF key has too many correction words");
+    key.cws.resize(num_cws);
+    for (auto& cw : key.cws) {
+        cw.dSL = in.get<uint64_t>();
+        cw.dSR = in.get<uint64_t>();
+        cw.dTL = in.get<uint8_t>() != 0;
+        cw.dTR = in.get<uint8_t>() != 0;
+    }
+
+    key.cwOuts.resize(in.get<uint32_t>());
+    in.get_words(key.cwOuts.data(), key.cwOuts.size());
+    return key;
+}
+
+// One query's item update material: its DPF key and this party's share of r
+// (open item delta) or of x and y (fused)
+struct ItemKeyShare {
+    DPFKey key;
+    std::vector<long long> r;
+    std::vector<long long> x;
+    long long y = 0;
+};
+
+// Client side of the P2 stream. Frames are read through one buffer that lives
+// as long as the connection, so bytes received past the current frame are
+// kept for the next one, and a frame usually arrives in a single read. A
+// reader over memory (an mmapped prep_bundle.hpp bundle) returns payloads in
+// place. P2 reads the clients' Refill frames with the same class.
+class PrepReader {
+public:
+    explicit PrepReader(tcp::socket& sock) : sock_(&sock) {}
+    PrepReader(const char* data, size_t length) : mem_(data), end_(length) {}
+
+    // Next frame, which must be of the given type. The payload stays valid
+    // until the next call.
+    awaitable<PrepPayload> next(PrepFrameType type) {
+        co_await fill(sizeof(PrepFrameHeader));
+        PrepFrameHeader h;
+        std::memcpy(&h, data() + pos_, sizeof(h));
+        if (std::memcmp(h.magic, PREP_FRAME_MAGIC, sizeof(h.magic)) != 0) {
+            throw std::runtime_error("Bad preprocessing frame magic");
+        }
+        if (h.version != PREP_FRAME_VERSION) throw std::runtime_error("Unsupported preprocessing frame version");
+        if (h.type != static_cast<uint16_t>(type)) {
+            throw std::runtime_error("Unexpected preprocessing frame type " + std::to_string(h.type));
+        }
+        if (h.length > (uint64_t(1) << 40)) throw std::runtime_error("Preprocessing frame too large");
+
+        co_await fill(sizeof(h) + h.length);
+        const char* payload = data() + pos_ + sizeof(h);
+        pos_ += sizeof(h) + h.length;
+        co_return PrepPayload(h, payload);
+    }
+
+    awaitable<PrepManifest> next_manifest() {
+        PrepPayload in = co_await next(PrepFrameType::Manifest);
+        PrepManifest m;
+        m.queries = in.get<uint32_t>();
+        m.k = in.get<uint32_t>();
+        m.triples_per_query = in.get<uint32_t>();
+        const uint8_t engine = in.get<uint8_t>();
+        if (engine != static_cast<uint8_t>(ItemEngine::DPF) && engine != static_cast<uint8_t>(ItemEngine::Stash)) {
+            throw std::runtime_error("P2 announced an unknown item engine");
+        }
+        m.engine = static_cast<ItemEngine>(engine);
+        m.epoch = in.get<uint32_t>();
+        const uint8_t randomness = in.get<uint8_t>();
+        if (randomness != static_cast<uint8_t>(PrepRandomness::Explicit) &&
+            randomness != static_cast<uint8_t>(PrepRandomness::Seeded)) {
+            throw std::runtime_error("P2 announced an unknown randomness mode");
+        }
+        m.randomness = static_cast<PrepRandomness>(randomness);
+        const uint8_t delta = in.get<uint8_t>();
+        if (delta != static_cast<uint8_t>(ItemDelta::Open) && delta != static_cast<uint8_t>(ItemDelta::Fused)) {
+            throw std::runtime_error("P2 announced an unknown item delta mode");
+        }
+        m.delta = static_cast<ItemDelta>(delta);
+        in.expect_end();
+        co_return m;
+    }
+
+    // The next query's item key; an ItemKeys frame may carry several
+    awaitable<ItemKeyShare> next_item_key(size_t k, ItemDelta delta) {
+        if (pending_keys_.empty()) {
+            PrepPayload in = co_await next(PrepFrameType::ItemKeys);
+            if (in.header.width != k) throw std::runtime_error("Item keys do not match the profile dimension");
+            for (uint32_t i = 0; i < in.header.count; ++i) {
+                ItemKeyShare item;
+                item.key = prep_get_dpf_key(in);
+                if (delta == ItemDelta::Fused) {
+                    item.x.resize(k);
+                    in.get_words(item.x.data(), k);
+                    item.y = in.get<long long>();
+                } else {
+                    item.r.resize(k);
+                    in.get_words(item.r.data(), k);
+                }
+                pending_keys_.push_back(std::move(item));
+            }
+            in.expect_end();
+            if (pending_keys_.empty()) throw std::runtime_error("Empty item key frame");
+        }
+        ItemKeyShare item = std::move(pending_keys_.front());
+        pending_keys_.pop_front();
+        co_return item;
+    }
+
+    // P2 side: a client's next refill request
+    awaitable<uint64_t> next_refill() {
+        PrepPayload in = co_await next(PrepFrameType::Refill);
+        const uint64_t queries = in.get<uint64_t>();
+        in.expect_end();
+        co_return queries;
+    }
+
+    awaitable<uint32_t> next_stash_row() {
+        PrepPayload in = co_await next(PrepFrameType::StashRow);
+        const uint32_t row = in.get<uint32_t>();
+        in.expect_end();
+        co_return row;
+    }
+
+    // This party's share of a stash shuffle for a rows x k matrix
+    awaitable<StashShuffleShare> next_stash_shuffle(size_t rows, size_t k) {
+        PrepPayload in = co_await next(PrepFrameType::StashShuffle);
+        if (in.header.width != k || in.get<uint32_t>() != rows) {
+            throw std::runtime_error("Stash shuffle does not match the item matrix");
+        }
+        StashShuffleShare share;
+        share.perm.resize(rows);
+        in.get_words(share.perm.data(), rows);
+        if (!is_permutation_of_rows(share.perm)) throw std::runtime_error("Stash shuffle is not a permutation");
+        share.w.resize(rows * k);
+        in.get_words(share.w.data(), share.w.size());
+        share.seed_a = in.get<uint64_t>();
+        share.seed_c = in.get<uint64_t>();
+        in.expect_end();
+        co_return share;
+    }
+
+private:
+    const char* data() const { return sock_ ? buf_.data() : mem_; }
+
+    // Makes at least n unread bytes available, reading as much as has arrived
+    awaitable<void> fill(size_t n) {
+        if (end_ - pos_ >= n) co_return;
+        if (!sock_) throw std::runtime_error("Preprocessing bundle is truncated");
+        if (pos_ > 0) {
+            std::memmove(buf_.data(), buf_.data() + pos_, end_ - pos_);
+            end_ -= pos_;
+            pos_ = 0;
+        }
+        if (buf_.size() < n) buf_.resize(std::max<size_t>(n, 1 << 16));
+        end_ += co_await boost::asio::async_read(*sock_, boost::asio::buffer(buf_.data() + end_, buf_.size() - end_),
+                                                 boost::asio::transfer_at_least(n - end_), use_awaitable);
+    }
+
+    tcp::socket* sock_ = nullptr;
+    const char* mem_ = nullptr;
+    std::vector<char> buf_;
+    size_t pos_ = 0, end_ = 0;
+    std::deque<ItemKeyShare> pending_keys_;
+};
+
+// P2 side: reads a freshly accepted client's Hello and returns its party.
+// Exactly the frame is read, so the Refill frames behind it stay on the
+// socket for the dealer's reader.
+inline uint32_t prep_read_hello(tcp::socket& sock) {
+    char frame[sizeof(PrepFrameHeader) + sizeof(uint32_t)];
+    boost::asio::read(sock, boost::asio::buffer(frame));
+    PrepFrameHeader h;
+    std::memcpy(&h, frame, sizeof(h));
+    if (std::memcmp(h.magic, PREP_FRAME_MAGIC, sizeof(h.magic)) != 0 || h.version != PREP_FRAME_VERSION ||
+        h.type != static_cast<uint16_t>(PrepFrameType::Hello) || h.length != sizeof(uint32_t)) {
+        throw std::runtime_error("Client did not say which party it is");
+    }
+    PrepPayload in(h, frame + sizeof(h));
+    const uint32_t party = in.get<uint32_t>();
+    if (party > 1) throw std::runtime_error("Client claims to be party " + std::to_string(party));
+    return party;
+}
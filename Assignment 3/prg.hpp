@@ -0,0 +1,328 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define PRG_HAVE_X86_SIMD 1
+#endif
+
+// ----------------------- PRG for the DPF tree -----------------------
+// Two backends, recorded in every DPF key (DPFKey::prg):
+//  SMix: G(s) = (smix(s ^ C_L), smix(s ^ C_R), smix(s ^ C_TL) & 1, smix(s ^ C_TR) & 1)
+//        (same as gen_dpf.cpp), batched over AVX-512 or AVX2 lanes when the
+//        CPU has them.
+//  AES:  fixed-key AES-128 in Matyas-Meyer-Oseas mode, H(x) = AES_K(x) ^ x on
+//        the 128-bit block x = (s, tweak). One call per node: the low and high
+//        halves of H(s, 0) are the left and right children, their low bits
+//        the control bits. Needs AES-NI; batches run 8 blocks in flight.
+// prg_expand() applies G to a whole batch of seeds and prg_mix() computes the
+// per-seed word keyed by c (leaf output words) for a batch.
+
+enum class PRGKind : uint8_t { SMix = 0, AES = 1 };
+
+static inline uint64_t smix(uint64_t x){
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static constexpr uint64_t C_L = 0xA5A5A5A5A5A5A5A5ull;
+static constexpr uint64_t C_R = 0xC3C3C3C3C3C3C3C3ull;
+static constexpr uint64_t C_TL = 0xB4B4B4B4B4B4B4B4ull;
+static constexpr uint64_t C_TR = 0xD2D2D2D2D2D2D2D2ull;
+static constexpr uint64_t C_V = 0xEEEEEEEEEEEEEEEEull;
+
+struct PRGOut { uint64_t sL, sR; bool tL, tR; };
+
+static inline PRGOut G(uint64_t s){
+    uint64_t sL = smix(s ^ C_L);
+    uint64_t sR = smix(s ^ C_R);
+    bool tL = (smix(s ^ C_TL) & 1ULL);
+    bool tR = (smix(s ^ C_TR) & 1ULL);
+    return {sL, sR, tL, tR};
+}
+
+// G over n seeds: children seeds into sL/sR, control bits into tL/tR
+using PRGExpandFn = void (*)(const uint64_t* s, size_t n, uint64_t* sL, uint64_t* sR, uint8_t* tL, uint8_t* tR);
+// out[i] = smix(s[i] ^ c)
+using PRGMixFn = void (*)(const uint64_t* s, size_t n, uint64_t c, uint64_t* out);
+
+struct PRGKernels {
+    PRGExpandFn expand;
+    PRGMixFn mix;
+};
+
+static inline void prg_expand_scalar(const uint64_t* s, size_t n, uint64_t* sL, uint64_t* sR,
+                                     uint8_t* tL, uint8_t* tR){
+    for (size_t i = 0; i < n; ++i){
+        PRGOut g = G(s[i]);
+        sL[i] = g.sL; sR[i] = g.sR;
+        tL[i] = g.tL; tR[i] = g.tR;
+    }
+}
+
+static inline void prg_mix_scalar(const uint64_t* s, size_t n, uint64_t c, uint64_t* out){
+    for (size_t i = 0; i < n; ++i) out[i] = smix(s[i] ^ c);
+}
+
+#ifdef PRG_HAVE_X86_SIMD
+// GCC 12 flags the _mm512_undefined_* placeholders inside its own intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// AVX2 has no 64-bit multiply; build the low 64 bits from 32x32->64 products
+__attribute__((target("avx2")))
+static inline __m256i mul64_avx2(__m256i a, __m256i b){
+    __m256i lo = _mm256_mul_epu32(a, b);
+    __m256i c1 = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b);
+    __m256i c2 = _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32));
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(_mm256_add_epi64(c1, c2), 32));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i smix_avx2(__m256i x){
+    x = _mm256_add_epi64(x, _mm256_set1_epi64x((long long)0x9E3779B97F4A7C15ull));
+    x = mul64_avx2(_mm256_xor_si256(x, _mm256_srli_epi64(x, 30)), _mm256_set1_epi64x((long long)0xBF58476D1CE4E5B9ull));
+    x = mul64_avx2(_mm256_xor_si256(x, _mm256_srli_epi64(x, 27)), _mm256_set1_epi64x((long long)0x94D049BB133111EBull));
+    return _mm256_xor_si256(x, _mm256_srli_epi64(x, 31));
+}
+
+__attribute__((target("avx2")))
+static void prg_expand_avx2(const uint64_t* s, size_t n, uint64_t* sL, uint64_t* sR,
+                            uint8_t* tL, uint8_t* tR){
+    const __m256i cl = _mm256_set1_epi64x((long long)C_L), cr = _mm256_set1_epi64x((long long)C_R);
+    const __m256i ctl = _mm256_set1_epi64x((long long)C_TL), ctr = _mm256_set1_epi64x((long long)C_TR);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4){
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(sL + i), smix_avx2(_mm256_xor_si256(v, cl)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(sR + i), smix_avx2(_mm256_xor_si256(v, cr)));
+        alignas(32) uint64_t bl[4], br[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(bl), smix_avx2(_mm256_xor_si256(v, ctl)));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(br), smix_avx2(_mm256_xor_si256(v, ctr)));
+        for (int j = 0; j < 4; ++j){ tL[i + j] = bl[j] & 1; tR[i + j] = br[j] & 1; }
+    }
+    prg_expand_scalar(s + i, n - i, sL + i, sR + i, tL + i, tR + i);
+}
+
+__attribute__((target("avx2")))
+static void prg_mix_avx2(const uint64_t* s, size_t n, uint64_t c, uint64_t* out){
+    const __m256i vc = _mm256_set1_epi64x((long long)c);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4){
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), smix_avx2(_mm256_xor_si256(v, vc)));
+    }
+    prg_mix_scalar(s + i, n - i, c, out + i);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static inline __m512i smix_avx512(__m512i x){
+    x = _mm512_add_epi64(x, _mm512_set1_epi64((long long)0x9E3779B97F4A7C15ull));
+    x = _mm512_mullo_epi64(_mm512_xor_si512(x, _mm512_srli_epi64(x, 30)), _mm512_set1_epi64((long long)0xBF58476D1CE4E5B9ull));
+    x = _mm512_mullo_epi64(_mm512_xor_si512(x, _mm512_srli_epi64(x, 27)), _mm512_set1_epi64((long long)0x94D049BB133111EBull));
+    return _mm512_xor_si512(x, _mm512_srli_epi64(x, 31));
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static void prg_expand_avx512(const uint64_t* s, size_t n, uint64_t* sL, uint64_t* sR,
+                              uint8_t* tL, uint8_t* tR){
+    const __m512i cl = _mm512_set1_epi64((long long)C_L), cr = _mm512_set1_epi64((long long)C_R);
+    const __m512i ctl = _mm512_set1_epi64((long long)C_TL), ctr = _mm512_set1_epi64((long long)C_TR);
+    const __m512i one = _mm512_set1_epi64(1);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8){
+        __m512i v = _mm512_loadu_si512(s + i);
+        _mm512_storeu_si512(sL + i, smix_avx512(_mm512_xor_si512(v, cl)));
+        _mm512_storeu_si512(sR + i, smix_avx512(_mm512_xor_si512(v, cr)));
+        // Low bit of each lane -> 8 bytes
+        __m512i bl = _mm512_and_si512(smix_avx512(_mm512_xor_si512(v, ctl)), one);
+        __m512i br = _mm512_and_si512(smix_avx512(_mm512_xor_si512(v, ctr)), one);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(tL + i), _mm512_cvtepi64_epi8(bl));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(tR + i), _mm512_cvtepi64_epi8(br));
+    }
+    prg_expand_scalar(s + i, n - i, sL + i, sR + i, tL + i, tR + i);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static void prg_mix_avx512(const uint64_t* s, size_t n, uint64_t c, uint64_t* out){
+    const __m512i vc = _mm512_set1_epi64((long long)c);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8){
+        _mm512_storeu_si512(out + i, smix_avx512(_mm512_xor_si512(_mm512_loadu_si512(s + i), vc)));
+    }
+    prg_mix_scalar(s + i, n - i, c, out + i);
+}
+
+#pragma GCC diagnostic pop
+#endif
+
+
+// ----------------------- Fixed-key AES (MMO) backend -----------------------
+#ifdef PRG_HAVE_X86_SIMD
+struct AESRoundKeys { __m128i rk[11]; };
+
+__attribute__((target("aes,sse4.1")))
+static inline __m128i aes_key_step(__m128i key, __m128i gen){
+    gen = _mm_shuffle_epi32(gen, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, gen);
+}
+
+// Public, fixed AES key; its only job is to make H a good mixing function
+__attribute__((target("aes,sse4.1")))
+static inline AESRoundKeys aes_fixed_key(){
+    AESRoundKeys k;
+    k.rk[0] = _mm_set_epi64x(0x0F1E2D3C4B5A6978ll, 0x8796A5B4C3D2E1F0ll);
+    k.rk[1] = aes_key_step(k.rk[0], _mm_aeskeygenassist_si128(k.rk[0], 0x01));
+    k.rk[2] = aes_key_step(k.rk[1], _mm_aeskeygenassist_si128(k.rk[1], 0x02));
+    k.rk[3] = aes_key_step(k.rk[2], _mm_aeskeygenassist_si128(k.rk[2], 0x04));
+    k.rk[4] = aes_key_step(k.rk[3], _mm_aeskeygenassist_si128(k.rk[3], 0x08));
+    k.rk[5] = aes_key_step(k.rk[4], _mm_aeskeygenassist_si128(k.rk[4], 0x10));
+    k.rk[6] = aes_key_step(k.rk[5], _mm_aeskeygenassist_si128(k.rk[5], 0x20));
+    k.rk[7] = aes_key_step(k.rk[6], _mm_aeskeygenassist_si128(k.rk[6], 0x40));
+    k.rk[8] = aes_key_step(k.rk[7], _mm_aeskeygenassist_si128(k.rk[7], 0x80));
+    k.rk[9] = aes_key_step(k.rk[8], _mm_aeskeygenassist_si128(k.rk[8], 0x1B));
+    k.rk[10] = aes_key_step(k.rk[9], _mm_aeskeygenassist_si128(k.rk[9], 0x36));
+    return k;
+}
+
+static inline const AESRoundKeys& aes_round_keys(){
+    static const AESRoundKeys k = aes_fixed_key();
+    return k;
+}
+
+// H(x) = AES_K(x) ^ x for B independent blocks, interleaved so the AES units
+// stay busy
+template <int B>
+__attribute__((target("aes,sse4.1")))
+static inline void aes_mmo(__m128i (&x)[B]){
+    const AESRoundKeys& k = aes_round_keys();
+    __m128i y[B];
+    for (int j = 0; j < B; ++j) y[j] = _mm_xor_si128(x[j], k.rk[0]);
+    for (int r = 1; r < 10; ++r)
+        for (int j = 0; j < B; ++j) y[j] = _mm_aesenc_si128(y[j], k.rk[r]);
+    for (int j = 0; j < B; ++j) x[j] = _mm_xor_si128(_mm_aesenclast_si128(y[j], k.rk[10]), x[j]);
+}
+
+template <int B>
+__attribute__((target("aes,sse4.1")))
+static inline void aes_expand_blocks(const uint64_t* s, uint64_t* sL, uint64_t* sR, uint8_t* tL, uint8_t* tR){
+    __m128i x[B];
+    for (int j = 0; j < B; ++j) x[j] = _mm_set_epi64x(0, (long long)s[j]);
+    aes_mmo<B>(x);
+    for (int j = 0; j < B; ++j){
+        uint64_t lo = (uint64_t)_mm_cvtsi128_si64(x[j]);
+        uint64_t hi = (uint64_t)_mm_extract_epi64(x[j], 1);
+        sL[j] = lo & ~1ull; tL[j] = lo & 1;
+        sR[j] = hi & ~1ull; tR[j] = hi & 1;
+    }
+}
+
+__attribute__((target("aes,sse4.1")))
+static void prg_expand_aes(const uint64_t* s, size_t n, uint64_t* sL, uint64_t* sR, uint8_t* tL, uint8_t* tR){
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) aes_expand_blocks<8>(s + i, sL + i, sR + i, tL + i, tR + i);
+    for (; i < n; ++i) aes_expand_blocks<1>(s + i, sL + i, sR + i, tL + i, tR + i);
+}
+
+template <int B>
+__attribute__((target("aes,sse4.1")))
+static inline void aes_mix_blocks(const uint64_t* s, uint64_t c, uint64_t* out){
+    __m128i x[B];
+    for (int j = 0; j < B; ++j) x[j] = _mm_set_epi64x((long long)c, (long long)s[j]);
+    aes_mmo<B>(x);
+    for (int j = 0; j < B; ++j) out[j] = (uint64_t)_mm_cvtsi128_si64(x[j]);
+}
+
+__attribute__((target("aes,sse4.1")))
+static void prg_mix_aes(const uint64_t* s, size_t n, uint64_t c, uint64_t* out){
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) aes_mix_blocks<8>(s + i, c, out + i);
+    for (; i < n; ++i) aes_mix_blocks<1>(s + i, c, out + i);
+}
+#endif
+
+static inline bool prg_aes_available(){
+#ifdef PRG_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse4.1");
+#else
+    return false;
+#endif
+}
+
+// Picks the widest kernels this CPU supports. MPC_PRG_IMPL=scalar|avx2|avx512
+// forces one (falling back to a narrower one if the CPU lacks it).
+static inline PRGKernels prg_select(){
+    const char* env = std::getenv("MPC_PRG_IMPL");
+    const char* want = (env && *env) ? env : "";
+    const PRGKernels scalar{prg_expand_scalar, prg_mix_scalar};
+#ifdef PRG_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    const bool has512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+    const bool has2 = __builtin_cpu_supports("avx2");
+    const PRGKernels avx2{prg_expand_avx2, prg_mix_avx2};
+    const PRGKernels avx512{prg_expand_avx512, prg_mix_avx512};
+    if (std::strcmp(want, "scalar") == 0) return scalar;
+    if (std::strcmp(want, "avx2") == 0) return has2 ? avx2 : scalar;
+    if (has512) return avx512;
+    if (has2) return avx2;
+#else
+    (void)want;
+#endif
+    return scalar;
+}
+
+static inline const PRGKernels& prg_kernels(PRGKind kind){
+    static const PRGKernels smix_kernels = prg_select();
+    if (kind == PRGKind::SMix) return smix_kernels;
+    if (kind != PRGKind::AES) throw std::runtime_error("Unknown DPF PRG");
+#ifdef PRG_HAVE_X86_SIMD
+    static const PRGKernels aes_kernels{prg_expand_aes, prg_mix_aes};
+    if (prg_aes_available()) return aes_kernels;
+#endif
+    throw std::runtime_error("DPF key uses the AES PRG but this CPU has no AES-NI");
+}
+
+static inline void prg_expand(PRGKind kind, const uint64_t* s, size_t n, uint64_t* sL, uint64_t* sR,
+                              uint8_t* tL, uint8_t* tR){
+    prg_kernels(kind).expand(s, n, sL, sR, tL, tR);
+}
+
+static inline void prg_mix(PRGKind kind, const uint64_t* s, size_t n, uint64_t c, uint64_t* out){
+    prg_kernels(kind).mix(s, n, c, out);
+}
+
+// Single-seed versions, for point evaluation and key generation
+static inline PRGOut prg_node(PRGKind kind, uint64_t s){
+    if (kind == PRGKind::SMix) return G(s);
+    uint64_t sL, sR;
+    uint8_t tL, tR;
+    prg_expand(kind, &s, 1, &sL, &sR, &tL, &tR);
+    return {sL, sR, tL != 0, tR != 0};
+}
+
+static inline uint64_t prg_word(PRGKind kind, uint64_t s, uint64_t c){
+    if (kind == PRGKind::SMix) return smix(s ^ c);
+    uint64_t out;
+    prg_mix(kind, &s, 1, c, &out);
+    return out;
+}
+
+// PRG for newly generated keys, from MPC_DPF_PRG=smix|aes (default smix)
+static inline PRGKind prg_kind_from_env(){
+    const char* env = std::getenv("MPC_DPF_PRG");
+    if (!env || !*env || std::strcmp(env, "smix") == 0) return PRGKind::SMix;
+    if (std::strcmp(env, "aes") == 0) return PRGKind::AES;
+    throw std::runtime_error(std::string("Unknown MPC_DPF_PRG: ") + env);
+}
@@ -0,0 +1,74 @@
+// Compares the DPF PRG backends on this machine: node expansions per second
+// for each prg.hpp kernel, and full-domain DPF evaluation time per backend.
+//
+//   ./prg_bench [domain_size] [k] [leaf_bits]
+//
+// Defaults: domain_size = 2^20, k = 1, leaf_bits as chosen by P2
+// (dpf_default_leaf_bits). Full evaluation is also timed with leaf_bits = 0.
+#include "dpf.hpp"
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Best of a few runs, in seconds
+template <typename F>
+static double best_time(F&& f, int runs = 5) {
+    double best = 1e30;
+    for (int r = 0; r < runs; ++r) {
+        auto t0 = std::chrono::steady_clock::now();
+        f();
+        auto t1 = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(t1 - t0).count());
+    }
+    return best;
+}
+
+static void bench_kernel(const std::string& name, PRGExpandFn expand, const std::vector<uint64_t>& seeds) {
+    const size_t n = seeds.size();
+    std::vector<uint64_t> sL(n), sR(n);
+    std::vector<uint8_t> tL(n), tR(n);
+    double t = best_time([&] { expand(seeds.data(), n, sL.data(), sR.data(), tL.data(), tR.data()); });
+    std::cout << "  " << name << ": " << (n / t) / 1e6 << " M node expansions/s\n";
+}
+
+static void bench_eval(const std::string& name, PRGKind prg, uint64_t n, size_t k, int leaf_bits) {
+    std::mt19937_64 rng(1);
+    auto pair = generateDPF(n, n / 2, std::vector<uint64_t>(k, 0), rng, prg, leaf_bits);
+    double t = best_time([&] { auto out = evalFullDPF(pair.k0, n, pair.nbits); });
+    std::cout << "  " << name << ", leaf_bits " << leaf_bits << ": " << t * 1e3 << " ms ("
+              << (n / t) / 1e6 << " M points/s)\n";
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t n = (argc > 1) ? std::stoull(argv[1]) : (1ull << 20);
+    size_t k = (argc > 2) ? std::stoul(argv[2]) : 1;
+    if (n == 0 || k == 0) {
+        std::cerr << "Usage: ./prg_bench [domain_size] [k] [leaf_bits]\n";
+        return 1;
+    }
+    const int leaf_bits = (argc > 3) ? std::stoi(argv[3]) : dpf_default_leaf_bits(dpf_depth(n), k);
+
+    std::vector<uint64_t> seeds(n);
+    std::mt19937_64 rng(7);
+    for (auto& s : seeds) s = rng();
+
+    const bool has_aes = prg_aes_available();
+    std::cout << "PRG node expansion (" << n << " seeds):\n";
+    bench_kernel("smix scalar", prg_expand_scalar, seeds);
+#ifdef PRG_HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) bench_kernel("smix avx2", prg_expand_avx2, seeds);
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+        bench_kernel("smix avx512", prg_expand_avx512, seeds);
+    if (has_aes) bench_kernel("aes-ni mmo", prg_expand_aes, seeds);
+#endif
+    if (!has_aes) std::cout << "  aes-ni mmo: not supported on this CPU\n";
+
+    std::cout << "Full-domain DPF evaluation (n=" << n << ", k=" << k << "):\n";
+    for (int c : {0, leaf_bits}) {
+        bench_eval("smix", PRGKind::SMix, n, k, c);
+        if (has_aes) bench_eval("aes", PRGKind::AES, n, k, c);
+        if (leaf_bits == 0) break;
+    }
+    return 0;
+}
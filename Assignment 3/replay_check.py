@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""
+End-to-end check: replays the queries on the plaintext profiles written by
+gen_test_data.py and compares every row of the reconstructed U and V with it.
+Unlike checker.py this also catches updates that land on the wrong row, or a
+V left permuted. Run it after the clients, on the data/ they wrote.
+"""
+
+import os
+import struct
+import sys
+
+M64 = 1 << 64
+
+def wrap(x):
+    """The clients compute mod 2^64 on signed words"""
+    x %= M64
+    return x - M64 if x >= 1 << 63 else x
+
+def read_text(path):
+    with open(path) as f:
+        t = f.read().split()
+    r, c = int(t[0]), int(t[1])
+    v = list(map(int, t[2:2 + r * c]))
+    return [v[i * c:(i + 1) * c] for i in range(r)]
+
+def read_queries(path):
+    """Rows of user_idx, item_idx, v[0..k)"""
+    with open(path) as f:
+        t = f.read().split()
+    q, k = int(t[0]), int(t[1])
+    v = list(map(int, t[2:2 + q * (k + 2)]))
+    return [v[i * (k + 2):(i + 1) * (k + 2)] for i in range(q)]
+
+def read_binary(path):
+    """The share_store.hpp binary format, either layout"""
+    with open(path, "rb") as f:
+        magic, version, layout, _, r, c = struct.unpack("<4sIIIQQ", f.read(32))
+        if magic != b"SHMX" or version != 1:
+            raise ValueError(f"{path} is not a share matrix")
+        v = struct.unpack(f"<{r * c}q", f.read(8 * r * c))
+    if layout == 0:
+        return [list(v[i * c:(i + 1) * c]) for i in range(r)]
+    return [[v[j * r + i] for j in range(c)] for i in range(r)]
+
+def read_share(stem):
+    """Like the clients: the .bin file when it exists, else the .txt one"""
+    return read_binary(stem + ".bin") if os.path.exists(stem + ".bin") else read_text(stem + ".txt")
+
+def reconstruct(A, B):
+    return [[wrap(a + b) for a, b in zip(x, y)] for x, y in zip(A, B)]
+
+def main():
+    U = read_text("data/plain_U.txt")
+    V = read_text("data/plain_V.txt")
+    queries = read_queries("data/queries.txt")
+
+    for q in queries:
+        user, item = q[0], q[1]
+        # Both clients take the query's values as their share of v_j
+        v = [2 * x for x in q[2:]]
+        u = U[user]
+        f = 1 - sum(a * b for a, b in zip(u, v))
+        U[user] = [wrap(a + b * f) for a, b in zip(u, v)]
+        V[item] = [wrap(a + b * f) for a, b in zip(V[item], u)]
+
+    got_U = reconstruct(read_share("data/p0_shares/p0_U"), read_share("data/p1_shares/p1_U"))
+    got_V = reconstruct(read_share("data/p0_shares/p0_V"), read_share("data/p1_shares/p1_V"))
+    ok = True
+    for name, want, got in (("U", U, got_U), ("V", V, got_V)):
+        want = [[wrap(a) for a in row] for row in want]
+        bad = [i for i in range(max(len(want), len(got))) if i >= len(want) or i >= len(got) or want[i] != got[i]]
+        if bad:
+            ok = False
+            print(f"✗ {name}: {len(bad)} rows differ from the replay, first {bad[:10]}")
+        else:
+            print(f"✓ {name}: all {len(want)} rows match the replay")
+    return 0 if ok else 1
+
+if __name__ == "__main__":
+    sys.exit(main())
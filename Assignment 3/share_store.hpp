@@ -0,0 +1,289 @@
+#pragma once
+
+#include "common.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ----------------------- Binary share matrix format -----------------------
+// A 32-byte header followed by rows*cols little-endian int64 cells, either
+// row-major (cell (r,c) at r*cols+c) or column-major (at c*rows+r).
+static constexpr char SHARE_MATRIX_MAGIC[4] = {'S', 'H', 'M', 'X'};
+static constexpr uint32_t SHARE_MATRIX_VERSION = 1;
+
+enum class MatrixLayout : uint32_t { RowMajor = 0, ColMajor = 1 };
+
+struct ShareMatrixHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t layout;
+    uint32_t reserved;
+    uint64_t rows;
+    uint64_t cols;
+};
+static_assert(sizeof(ShareMatrixHeader) == 32, "binary share matrix header must be 32 bytes");
+
+// ----------------------- Resident share matrix -----------------------
+// Holds one party's share of U or V for the whole run. Binary files are
+// mmapped and updated in place, in the layout recorded in their header; text
+// files ("rows cols\n" + one row per line) are parsed once at startup into
+// text_layout. Either way reads and writes are O(k) and the file is only
+// synced when flush() is called.
+//
+// Column-major keeps each feature dimension contiguous, which suits the
+// full-domain DPF update of V (one stream per dimension); rows are then
+// gathered with stride rows().
+class ShareMatrix {
+public:
+    ShareMatrix() = default;
+    explicit ShareMatrix(std::string path, MatrixLayout text_layout = MatrixLayout::RowMajor)
+        : path_(std::move(path)), layout_(text_layout) { open(); }
+
+    ShareMatrix(const ShareMatrix&) = delete;
+    ShareMatrix& operator=(const ShareMatrix&) = delete;
+
+    ~ShareMatrix() {
+        try { if (flush_on_close_) flush(); }
+        catch (const std::exception& e) { std::cerr << "ShareMatrix: " << e.what() << "\n"; }
+        if (map_) munmap(map_, map_len_);
+    }
+
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    MatrixLayout layout() const { return layout_; }
+    bool is_binary() const { return map_ != nullptr; }
+    const std::string& path() const { return path_; }
+
+    // Unchecked cell access; the non-const overload marks the matrix dirty.
+    // Safe to call from several threads as long as they touch disjoint cells.
+    long long& cell(int r, int c) {
+        dirty_.store(true, std::memory_order_relaxed);
+        return cells_[index(r, c)];
+    }
+
+    long long cell(int r, int c) const { return cells_[index(r, c)]; }
+
+    // Contiguous storage of row r (row-major) or column c (column-major);
+    // marks the matrix dirty.
+    long long* row_data(int r) {
+        if (layout_ != MatrixLayout::RowMajor) throw std::runtime_error("row_data on a column-major " + path_);
+        dirty_.store(true, std::memory_order_relaxed);
+        return cells_ + static_cast<size_t>(r) * cols_;
+    }
+
+    long long* column_data(int c) {
+        if (layout_ != MatrixLayout::ColMajor) throw std::runtime_error("column_data on a row-major " + path_);
+        dirty_.store(true, std::memory_order_relaxed);
+        return cells_ + static_cast<size_t>(c) * rows_;
+    }
+
+    // Row reads and writes copy directly (row-major) or gather/scatter with
+    // stride rows() (column-major).
+    random_vector read_row(int r) const {
+        check_row(r);
+        random_vector vec;
+        vec.data.resize(cols_);
+        const long long* src = cells_ + row_offset(r);
+        const size_t stride = row_stride();
+        for (int c = 0; c < cols_; ++c) vec.data[c] = src[c * stride];
+        return vec;
+    }
+
+    void write_row(int r, const std::vector<long long>& newrow) {
+        check_row(r);
+        if ((int)newrow.size() != cols_)
+            throw std::runtime_error("New row has wrong length in update for " + path_);
+        long long* dst = cells_ + row_offset(r);
+        const size_t stride = row_stride();
+        for (int c = 0; c < cols_; ++c) dst[c * stride] = newrow[c];
+        dirty_.store(true, std::memory_order_relaxed);
+    }
+
+    // Persist pending changes: msync for binary files, atomic rewrite for text.
+    void flush() {
+        if (!dirty_.load()) return;
+        if (map_) {
+            if (msync(map_, map_len_, MS_SYNC) != 0)
+                throw std::runtime_error("msync failed for " + path_);
+        } else {
+            const std::string tmp = path_ + ".tmp";
+            save_text(tmp);
+            std::remove(path_.c_str());
+            if (std::rename(tmp.c_str(), path_.c_str()) != 0) {
+                throw std::runtime_error("Failed to rename " + tmp + " -> " + path_);
+            }
+        }
+        dirty_.store(false);
+    }
+
+    // Moves a full text copy of the matrix, written with save_text(), into
+    // place; the matrix has no pending changes afterwards
+    void replace_with(const std::string& saved_path) {
+        std::remove(path_.c_str());
+        if (std::rename(saved_path.c_str(), path_.c_str()) != 0) {
+            throw std::runtime_error("Failed to rename " + saved_path + " -> " + path_);
+        }
+        dirty_.store(false);
+    }
+
+    // Whether the destructor writes back pending changes (the default). Off
+    // when the file must only ever hold checkpointed state.
+    void set_flush_on_close(bool on) { flush_on_close_ = on; }
+
+    void save_text(const std::string& out_path) const {
+        std::ofstream out(out_path);
+        if (!out) throw std::runtime_error("Failed to open " + out_path);
+        out << rows_ << " " << cols_ << "\n";
+        for (int r = 0; r < rows_; ++r) {
+            for (int c = 0; c < cols_; ++c) {
+                if (c) out << ' ';
+                out << cells_[index(r, c)];
+            }
+            out << "\n";
+        }
+        if (!out) throw std::runtime_error("Write failed for " + out_path);
+    }
+
+    void save_binary(const std::string& out_path, MatrixLayout out_layout) const {
+        std::ofstream out(out_path, std::ios::binary);
+        if (!out) throw std::runtime_error("Failed to open " + out_path);
+        ShareMatrixHeader h{};
+        std::memcpy(h.magic, SHARE_MATRIX_MAGIC, sizeof(h.magic));
+        h.version = SHARE_MATRIX_VERSION;
+        h.layout = static_cast<uint32_t>(out_layout);
+        h.rows = static_cast<uint64_t>(rows_);
+        h.cols = static_cast<uint64_t>(cols_);
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+
+        const bool row_major = out_layout == MatrixLayout::RowMajor;
+        std::vector<long long> line(row_major ? cols_ : rows_);
+        const int outer = row_major ? rows_ : cols_;
+        for (int o = 0; o < outer; ++o) {
+            for (int i = 0; i < (int)line.size(); ++i) {
+                line[i] = row_major ? cells_[index(o, i)] : cells_[index(i, o)];
+            }
+            out.write(reinterpret_cast<const char*>(line.data()), line.size() * sizeof(long long));
+        }
+        if (!out) throw std::runtime_error("Write failed for " + out_path);
+    }
+
+private:
+    size_t index(int r, int c) const {
+        return layout_ == MatrixLayout::RowMajor ? static_cast<size_t>(r) * cols_ + c
+                                                 : static_cast<size_t>(c) * rows_ + r;
+    }
+
+    size_t row_offset(int r) const {
+        return layout_ == MatrixLayout::RowMajor ? static_cast<size_t>(r) * cols_ : static_cast<size_t>(r);
+    }
+
+    size_t row_stride() const { return layout_ == MatrixLayout::RowMajor ? 1 : static_cast<size_t>(rows_); }
+
+    void check_row(int r) const {
+        if (r < 0 || r >= rows_) throw std::runtime_error("Row index out of range in " + path_);
+    }
+
+    void open() {
+        char magic[sizeof(SHARE_MATRIX_MAGIC)] = {};
+        {
+            std::ifstream f(path_, std::ios::binary);
+            if (!f) throw std::runtime_error("Failed to open " + path_);
+            f.read(magic, sizeof(magic));
+        }
+        if (std::memcmp(magic, SHARE_MATRIX_MAGIC, sizeof(magic)) == 0) map_binary();
+        else load_text();
+    }
+
+    void load_text() {
+        std::ifstream f(path_);
+        if (!f) throw std::runtime_error("Failed to open " + path_);
+        if (!(f >> rows_ >> cols_) || rows_ < 0 || cols_ < 0) {
+            throw std::runtime_error("Bad header in " + path_);
+        }
+        owned_.resize(static_cast<size_t>(rows_) * cols_);
+        cells_ = owned_.data();
+        for (int r = 0; r < rows_; ++r) {
+            for (int c = 0; c < cols_; ++c) {
+                if (!(f >> cells_[index(r, c)])) throw std::runtime_error("Matrix body parse error in " + path_);
+            }
+        }
+    }
+
+    // The header is checked before the file is mapped, so a bad file never
+    // leaves a mapping behind
+    void map_binary() {
+        int fd = ::open(path_.c_str(), O_RDWR);
+        if (fd < 0) throw std::runtime_error("Failed to open " + path_);
+        struct stat st{};
+        ShareMatrixHeader h;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(h) || ::pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+            ::close(fd);
+            throw std::runtime_error("Bad header in " + path_);
+        }
+        const size_t len = static_cast<size_t>(st.st_size);
+        uint64_t cells = 0, bytes = 0;
+        std::string bad;
+        if (h.version != SHARE_MATRIX_VERSION) {
+            bad = "Unsupported share matrix version in " + path_;
+        } else if (h.layout != static_cast<uint32_t>(MatrixLayout::RowMajor) &&
+                   h.layout != static_cast<uint32_t>(MatrixLayout::ColMajor)) {
+            bad = "Unknown share matrix layout in " + path_;
+        } else if (h.rows > INT32_MAX || h.cols > INT32_MAX || __builtin_mul_overflow(h.rows, h.cols, &cells) ||
+                   __builtin_mul_overflow(cells, sizeof(long long), &bytes) || len - sizeof(h) != bytes) {
+            // rows * cols * 8 is checked, so a crafted header cannot wrap
+            // around to the file size
+            bad = "Share matrix size does not match header in " + path_;
+        }
+        if (!bad.empty()) {
+            ::close(fd);
+            throw std::runtime_error(bad);
+        }
+
+        void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error("mmap failed for " + path_);
+        map_ = p;
+        map_len_ = len;
+
+        rows_ = static_cast<int>(h.rows);
+        cols_ = static_cast<int>(h.cols);
+        layout_ = static_cast<MatrixLayout>(h.layout);
+        cells_ = reinterpret_cast<long long*>(static_cast<char*>(map_) + sizeof(h));
+    }
+
+    std::string path_;
+    int rows_ = 0, cols_ = 0;
+    MatrixLayout layout_ = MatrixLayout::RowMajor;
+    long long* cells_ = nullptr;
+    std::vector<long long> owned_;  // text-backed storage
+    void* map_ = nullptr;           // binary-backed storage
+    size_t map_len_ = 0;
+    std::atomic<bool> dirty_{false};
+    bool flush_on_close_ = true;
+};
+
+// Prefer the binary share file when it exists, otherwise fall back to text.
+inline std::string share_matrix_path(const char* bin_path, const char* text_path) {
+    struct stat st{};
+    return ::stat(bin_path, &st) == 0 ? bin_path : text_path;
+}
+
+// Number of queries between flushes of the share matrices to disk, taken from
+// MPC_FLUSH_EVERY. 0 (the default) writes them back once, after the last query.
+inline int share_flush_interval() {
+    const char* env = std::getenv("MPC_FLUSH_EVERY");
+    if (!env || !*env) return 0;
+    int n = std::atoi(env);
+    return n > 0 ? n : 0;
+}
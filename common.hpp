@@ -18,6 +18,9 @@ namespace this_coro = boost::asio::this_coro;
 #define UPPER_LIM 100
 #define P0_USER_SHARES_FILE "/data/p0_shares/p0_U.txt"
 #define P1_USER_SHARES_FILE "/data/p1_shares/p1_U.txt"
+// Binary (mmap-able) variants; used instead of the .txt files when present
+#define P0_USER_SHARES_BIN "/data/p0_shares/p0_U.bin"
+#define P1_USER_SHARES_BIN "/data/p1_shares/p1_U.bin"
 #define P0_QUERIES_SHARES_FILE "/data/p0_shares/p0_queries.txt"
 #define P1_QUERIES_SHARES_FILE "/data/p1_shares/p1_queries.txt"
 #define P0_MULT_SHARES_FILE "/data/p0_shares/p0_mult.txt"
@@ -4,15 +4,18 @@
 #include <random>
 #include <string>
 #include <cstdint>
+#include <cstdio>
 #include <stdexcept>
 #include <sstream>
 #include "common.hpp"
+#include "share_store.hpp"
 struct Args {
     int m, n, k, q;
     bool have_seed = false;
     uint64_t seed = 0;
     bool packets = false;
     bool debug = false;          // NEW
+    bool binary = false;         // also write U shares in the binary mmap format
 };
 
 static bool starts_with(const std::string& s, const std::string& p) {
@@ -22,7 +25,7 @@ static bool starts_with(const std::string& s, const std::string& p) {
 static Args parse_args(int argc, char* argv[]) {
     if (argc < 5) {
         throw std::runtime_error(
-            "Usage: ./gen_queries <m> <n> <k> <q> [--seed=SEED] [--debug]");
+            "Usage: ./gen_queries <m> <n> <k> <q> [--seed=SEED] [--debug] [--binary]");
     }
     Args a{};
     a.m = std::stoi(argv[1]);
@@ -39,6 +42,8 @@ static Args parse_args(int argc, char* argv[]) {
             a.seed = std::stoull(arg.substr(8));
         } else if (arg == "--debug") {       // NEW
             a.debug = true;
+        } else if (arg == "--binary") {
+            a.binary = true;
         } else {
             std::ostringstream oss;
             oss << "Unknown option: " << arg;
@@ -122,8 +127,36 @@ int main(int argc, char* argv[]) {
             }
         };
 
+        // Same matrix in the row-major binary format (see share_store.hpp)
+        const auto write_matrix_bin = [](const std::string& path, int rows, int cols,
+                                         const std::vector<std::vector<int64_t>>& M) {
+
+            std::ofstream f(path, std::ios::binary);
+            if (!f) throw std::runtime_error("Failed to open " + path);
+            ShareMatrixHeader h{};
+            std::memcpy(h.magic, SHARE_MATRIX_MAGIC, sizeof(h.magic));
+            h.version = SHARE_MATRIX_VERSION;
+            h.layout = static_cast<uint32_t>(MatrixLayout::RowMajor);
+            h.rows = rows;
+            h.cols = cols;
+            f.write(reinterpret_cast<const char*>(&h), sizeof(h));
+            for (int r = 0; r < rows; ++r) {
+                f.write(reinterpret_cast<const char*>(M[r].data()), cols * sizeof(int64_t));
+            }
+        };
+
         write_matrix(P0_USER_SHARES_FILE, m, k, U0);
         write_matrix(P1_USER_SHARES_FILE, m, k, U1);
+        if (args.binary) {
+            write_matrix_bin(P0_USER_SHARES_BIN, m, k, U0);
+            write_matrix_bin(P1_USER_SHARES_BIN, m, k, U1);
+        } else {
+            // The clients prefer a .bin file over the .txt one, so a stale one
+            // from an earlier --binary run would hide the new shares
+            for (const char* path : {P0_USER_SHARES_BIN, P1_USER_SHARES_BIN}) {
+                if (std::remove(path) == 0) std::cout << "Removed stale " << path << "\n";
+            }
+        }
         // write_matrix("/data/p0_shares/p0_V.txt", n, k, V0);
         // write_matrix("/data/p1_shares/p1_V.txt", n, k, V1);
 
@@ -1,4 +1,5 @@
 #include "common.hpp"
+#include "share_store.hpp"
 #include <boost/asio/awaitable.hpp>
 #include <boost/asio/co_spawn.hpp>
 #include <boost/asio/use_awaitable.hpp>
@@ -73,11 +74,11 @@ awaitable<void> exchange_blinded(tcp::socket socket, int value_to_send) {
     co_return;
 }
 
-static inline const char* user_matrix_path() {
+static inline std::string user_matrix_path() {
 #ifdef ROLE_p0
-    return P0_USER_SHARES_FILE;
+    return share_matrix_path(P0_USER_SHARES_BIN, P0_USER_SHARES_FILE);
 #else
-    return P1_USER_SHARES_FILE;
+    return share_matrix_path(P1_USER_SHARES_BIN, P1_USER_SHARES_FILE);
 #endif
 }
 static inline const char* query_path() {
@@ -246,93 +247,6 @@ awaitable<void> recv_all_shares_from_P2(tcp::socket& sock,
     co_return;
 }
 
-// ----------------------- Shares Read Write -----------------------
-static random_vector
-read_row_from_matrix_file(const std::string& path, int row_index /*0-based*/) {
-    std::ifstream f(path);
-    if (!f) throw std::runtime_error("Failed to open " + path);
-
-    int rows=0, cols=0;
-    if (!(f >> rows >> cols)) {
-        throw std::runtime_error("Bad header in " + path);
-    }
-    if (row_index < 0 || row_index >= rows) {
-        throw std::runtime_error("Row index out of range in " + path);
-    }
-
-    // skip rows before target
-    std::string line;
-    std::getline(f, line); // consume end of header line
-    for (int r = 0; r < row_index; ++r) {
-        std::getline(f, line);
-        if (!f) throw std::runtime_error("Unexpected EOF while skipping rows in " + path);
-    }
-
-    // read the row
-    std::getline(f, line);
-    if (!f) throw std::runtime_error("Unexpected EOF reading row in " + path);
-
-    std::istringstream iss(line);
-    std::vector<long long> row;
-    row.reserve(cols);
-    for (int c = 0; c < cols; ++c) {
-        long long v;
-        if (!(iss >> v)) {
-            throw std::runtime_error("Row parse error in " + path);
-        }
-        row.push_back(v);
-    }
-    random_vector vec(row.size());
-    vec.data = row;
-    return vec;
-}
-
-// --- optional: write back one row (safe rewrite via temp file+rename) ---
-static void
-update_row_in_matrix_file(const std::string& path, int row_index,
-                          const std::vector<long long>& newrow) {
-    // Read entire matrix
-    std::ifstream f(path);
-    if (!f) throw std::runtime_error("Failed to open " + path);
-
-    int rows=0, cols=0;
-    if (!(f >> rows >> cols)) throw std::runtime_error("Bad header in " + path);
-    if (row_index < 0 || row_index >= rows)
-        throw std::runtime_error("Row index out of range for update in " + path);
-
-    std::vector<std::vector<long long>> M(rows, std::vector<long long>(cols));
-    for (int r = 0; r < rows; ++r) {
-        for (int c = 0; c < cols; ++c) {
-            if (!(f >> M[r][c])) throw std::runtime_error("Matrix body parse error in " + path);
-        }
-    }
-    if ((int)newrow.size() != cols)
-        throw std::runtime_error("New row has wrong length in update for " + path);
-
-    // Update row
-    M[row_index] = newrow;
-
-    // Rewrite atomically
-    const std::string tmp = path + ".tmp";
-    {
-        std::ofstream out(tmp);
-        if (!out) throw std::runtime_error("Failed to open temp " + tmp);
-        out << rows << " " << cols << "\n";
-        for (int r = 0; r < rows; ++r) {
-            for (int c = 0; c < cols; ++c) {
-                if (c) out << ' ';
-                out << M[r][c];
-            }
-            out << "\n";
-        }
-    }
-    // Replace
-    std::remove(path.c_str()); // ignore result
-    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
-        throw std::runtime_error("Failed to rename " + tmp + " -> " + path);
-    }
-}
-
 // --- header for exchanging two vectors ---
 struct VecPairHeader {
     int magic;     // 'DXCH' = 0x44584348
@@ -522,7 +436,8 @@ static boost::asio::awaitable<long long> secure_mpc_multiplication(long long a,
 // ----------------------- MPC dot product stub -----------------------
 static boost::asio::awaitable<long long> mpc_dot_product_async(const std::vector<long long>& q, const int qidx,
                                  DuAtAllahClient& s, std::vector<DuAtAllahMultClient>& vmuls,
-                                 tcp::socket& peer_sock /* use for your protocol */) {
+                                 tcp::socket& peer_sock /* use for your protocol */,
+                                 ShareMatrix& U_store) {
     
 
     const long long user_idx = static_cast<long long>(q[0]);
@@ -530,12 +445,8 @@ static boost::asio::awaitable<long long> mpc_dot_product_async(const std::vector
 
     std::cout<<"query is by user #"<< user_idx <<"\n";
 
-    // 1) Load my shares for this (user,row) and (item,row) from files (based on ROLE)
-    const std::string U_path = user_matrix_path();
-    // const std::string V_path = item_matrix_path();
-
-    random_vector user_share = read_row_from_matrix_file(U_path, user_idx);
-    // random_vector item_share = read_row_from_matrix_file(V_path, item_idx);
+    // 1) Load my shares for this (user,row) from the resident store
+    random_vector user_share = U_store.read_row(user_idx);
     random_vector item_share(q.size()-1);
 
     for(int i=1 ; i<q.size() ; i++) item_share[i-1] = q[i];
@@ -596,7 +507,7 @@ static boost::asio::awaitable<long long> mpc_dot_product_async(const std::vector
     user_share = user_share + item_share;
     
     append_result_share_to_file(qidx, user_share, user_idx);
-    update_row_in_matrix_file(U_path, user_idx, user_share.data);
+    U_store.write_row(user_idx, user_share.data);
 
     co_return 0LL;
 }
@@ -641,6 +552,10 @@ awaitable<void> run(boost::asio::io_context& io_context) {
         queries.resize(received_shares.size());
     }
 
+    // Load the user share matrix once; it stays resident for the whole run
+    ShareMatrix U_store(user_matrix_path());
+    const int flush_every = share_flush_interval();
+
     // Step 5: process each query in strict lockstep
     for (std::size_t i = 0; i < queries.size(); ++i) {
         // per-query barrier to ensure both parties use the same query index
@@ -648,11 +563,14 @@ awaitable<void> run(boost::asio::io_context& io_context) {
         co_await barrier_query(peer_sock, static_cast<int>(i));
 
         // compute the MPC dot product share
-        co_await mpc_dot_product_async(queries[i], i, received_shares[i], received_mul_shares[i], peer_sock);
+        co_await mpc_dot_product_async(queries[i], i, received_shares[i], received_mul_shares[i], peer_sock, U_store);
+
+        if (flush_every > 0 && (i + 1) % flush_every == 0) U_store.flush();
 
         // debug print
         std::cout << "Processed query #" << i << "\n";
     }
+    U_store.flush();
 
     co_return;
 }